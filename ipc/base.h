@@ -66,6 +66,9 @@ IPC_EXPORT IPC_TYPE(_ipc_type_date);
 #define IPC_TYPE_DATA (&_ipc_type_data)
 IPC_EXPORT IPC_TYPE(_ipc_type_data);
 
+#define IPC_TYPE_SHMEM (&_ipc_type_shmem)
+IPC_EXPORT IPC_TYPE(_ipc_type_shmem);
+
 #define IPC_TYPE_STRING (&_ipc_type_string)
 IPC_EXPORT IPC_TYPE(_ipc_type_string);
 
@@ -144,6 +147,16 @@ const void * ipc_data_get_bytes_ptr(ipc_object_t xdata);
 
 size_t ipc_data_get_bytes(ipc_object_t xdata, void *buffer, size_t off, size_t length);
 
+#pragma mark Shared Memory
+
+ipc_object_t ipc_shmem_create(size_t length);
+
+ipc_object_t ipc_shmem_create_with_bytes(const void *bytes, size_t length);
+
+size_t ipc_shmem_get_length(ipc_object_t xshmem);
+
+void * ipc_shmem_get_bytes_ptr(ipc_object_t xshmem);
+
 #pragma mark String
 
 ipc_object_t ipc_error_create(const void *event);
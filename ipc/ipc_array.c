@@ -7,9 +7,34 @@
 //
 
 #include <sys/types.h>
+#include <errno.h>
 #include "ipc_array.h"
 #include "ipc_internal.h"
 
+/*
+ * Arrays hold their items in one vector of retained object pointers that
+ * doubles from IPC_ARRAY_MIN_CAPACITY, so indexing is constant time and an
+ * object can sit in any number of arrays.
+ */
+__private_extern__ int
+_ipc_array_reserve(struct ipc_object *xo, size_t capacity)
+{
+    struct ipc_object **items;
+
+    if (capacity <= xo->xo_array.xa_capacity)
+        return (0);
+
+    if ((items = realloc(xo->xo_array.xa_items, capacity * sizeof(*items))) == NULL)
+    {
+        errno = ENOMEM;
+        return (-1);
+    }
+
+    xo->xo_array.xa_items = items;
+    xo->xo_array.xa_capacity = capacity;
+    return (0);
+}
+
 ipc_object_t ipc_array_create(const ipc_object_t *objects, size_t count)
 {
     struct ipc_object *xo;
@@ -17,6 +42,7 @@ ipc_object_t ipc_array_create(const ipc_object_t *objects, size_t count)
     ipc_u val = {0};
 
     xo = _ipc_prim_create(_IPC_TYPE_ARRAY, val, 0);
+    _ipc_array_reserve(xo, count);
 
     for (i = 0; i < count; i++)
         ipc_array_append_value(xo, objects[i]);
@@ -26,11 +52,8 @@ ipc_object_t ipc_array_create(const ipc_object_t *objects, size_t count)
 
 void ipc_array_set_value(ipc_object_t xarray, size_t index, ipc_object_t value)
 {
-    struct ipc_object *xotmp, *xotmp2;
-
     struct ipc_object *xo = xarray;
-    struct ipc_array_head *arr = &xo->xo_array;
-    size_t i = 0;
+    struct ipc_object *old;
 
     if (index == IPC_ARRAY_APPEND)
         return ipc_array_append_value(xarray, value);
@@ -38,48 +61,34 @@ void ipc_array_set_value(ipc_object_t xarray, size_t index, ipc_object_t value)
     if (index >= (size_t)xo->xo_size)
         return;
 
-    TAILQ_FOREACH_SAFE(xotmp, arr, xo_link, xotmp2)
-    {
-        if (i++ == index)
-        {
-            TAILQ_INSERT_AFTER(arr, (struct ipc_object *)value,
-                               xotmp, xo_link);
-            TAILQ_REMOVE(arr, xotmp, xo_link);
-            ipc_retain(value);
-            ipc_release(xotmp);
-            break;
-        }
-    }
+    old = xo->xo_array.xa_items[index];
+    xo->xo_array.xa_items[index] = ipc_retain(value);
+    ipc_release(old);
 }
 
 void ipc_array_append_value(ipc_object_t xarray, ipc_object_t value)
 {
-
     struct ipc_object *xo = xarray;
-    struct ipc_array_head *arr = &xo->xo_array;
+    size_t capacity = xo->xo_array.xa_capacity;
+
+    if (xo->xo_size == capacity &&
+        _ipc_array_reserve(xo, capacity ? capacity * 2 : IPC_ARRAY_MIN_CAPACITY) != 0)
+    {
+        debugf("cannot grow array");
+        return;
+    }
 
-    TAILQ_INSERT_TAIL(arr, (struct ipc_object *)value, xo_link);
-    ipc_retain(value);
+    xo->xo_array.xa_items[xo->xo_size++] = ipc_retain(value);
 }
 
 ipc_object_t ipc_array_get_value(ipc_object_t xarray, size_t index)
 {
-    struct ipc_object *xotmp;
-
     struct ipc_object *xo = xarray;
-    struct ipc_array_head *arr = &xo->xo_array;
-    size_t i = 0;
 
-    if (index > xo->xo_size)
+    if (index >= xo->xo_size)
         return (NULL);
 
-    TAILQ_FOREACH(xotmp, arr, xo_link)
-    {
-        if (i++ == index)
-            return (xotmp);
-    }
-
-    return (NULL);
+    return (xo->xo_array.xa_items[index]);
 }
 
 size_t ipc_array_get_count(ipc_object_t xarray)
@@ -91,49 +100,57 @@ size_t ipc_array_get_count(ipc_object_t xarray)
 void ipc_array_set_bool(ipc_object_t xarray, size_t index, bool value)
 {
     struct ipc_object *xotmp = ipc_bool_create(value);
-    return (ipc_array_set_value(xarray, index, xotmp));
+    ipc_array_set_value(xarray, index, xotmp);
+    ipc_release(xotmp);
 }
 
 void ipc_array_set_int64(ipc_object_t xarray, size_t index, int64_t value)
 {
     struct ipc_object *xotmp = ipc_int64_create(value);
-    return (ipc_array_set_value(xarray, index, xotmp));
+    ipc_array_set_value(xarray, index, xotmp);
+    ipc_release(xotmp);
 }
 
 void ipc_array_set_uint64(ipc_object_t xarray, size_t index, uint64_t value)
 {
     struct ipc_object *xotmp = ipc_uint64_create(value);
-    return (ipc_array_set_value(xarray, index, xotmp));
+    ipc_array_set_value(xarray, index, xotmp);
+    ipc_release(xotmp);
 }
 
 void ipc_array_set_double(ipc_object_t xarray, size_t index, double value)
 {
     struct ipc_object *xotmp = ipc_double_create(value);
-    return (ipc_array_set_value(xarray, index, xotmp));
+    ipc_array_set_value(xarray, index, xotmp);
+    ipc_release(xotmp);
 }
 
 void ipc_array_set_date(ipc_object_t xarray, size_t index, int64_t value)
 {
     struct ipc_object *xotmp = ipc_date_create(value);
-    return (ipc_array_set_value(xarray, index, xotmp));
+    ipc_array_set_value(xarray, index, xotmp);
+    ipc_release(xotmp);
 }
 
 void ipc_array_set_data(ipc_object_t xarray, size_t index, const void *data, size_t length)
 {
     struct ipc_object *xotmp = ipc_data_create(data, length);
-    return (ipc_array_set_value(xarray, index, xotmp));
+    ipc_array_set_value(xarray, index, xotmp);
+    ipc_release(xotmp);
 }
 
 void ipc_array_set_string(ipc_object_t xarray, size_t index, const char *string)
 {
     struct ipc_object *xotmp = ipc_string_create(string);
-    return (ipc_array_set_value(xarray, index, xotmp));
+    ipc_array_set_value(xarray, index, xotmp);
+    ipc_release(xotmp);
 }
 
 void ipc_array_set_uuid(ipc_object_t xarray, size_t index, const uuid_t value)
 {
     struct ipc_object *xotmp = ipc_uuid_create(value);
-    return (ipc_array_set_value(xarray, index, xotmp));
+    ipc_array_set_value(xarray, index, xotmp);
+    ipc_release(xotmp);
 }
 
 bool ipc_array_get_bool(ipc_object_t xarray, size_t index)
@@ -187,14 +204,12 @@ const char *ipc_array_get_string(ipc_object_t xarray, size_t index)
 
 bool ipc_array_apply(ipc_object_t xarray, ipc_array_applier_t applier)
 {
-    struct ipc_object *xotmp;
-    size_t i = 0;
     struct ipc_object *xo = xarray;
-    struct ipc_array_head *arr = &xo->xo_array;
+    size_t i;
 
-    TAILQ_FOREACH(xotmp, arr, xo_link)
+    for (i = 0; i < xo->xo_size; i++)
     {
-        if (!applier(i++, xotmp))
+        if (!applier(i, xo->xo_array.xa_items[i]))
             return (false);
     }
 
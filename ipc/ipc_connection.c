@@ -7,6 +7,7 @@
 //
 
 #include <errno.h>
+#include <sys/param.h>
 #ifdef __APPLE__
 #include <libkern/OSAtomic.h>
 #define IPC_CONNECTION_NEXT_ID(conn) (OSAtomicAdd64(1,(OSAtomic_int64_aligned64_t *)&conn->xc_last_id))
@@ -21,9 +22,38 @@
 #include "ipc_array.h"
 #include "ipc_dictionary.h"
 #include "unix.h"
-
-static void ipc_send(ipc_connection_t xconn, ipc_object_t message, uint64_t id);
-static void ipc_connection_dispatch_callback(struct ipc_connection *conn, ipc_object_t result, uint64_t id);
+#include "shm.h"
+
+static void ipc_send(ipc_connection_t xconn, ipc_object_t message, uint64_t id, uint64_t flags, uint64_t deadline);
+static void ipc_connection_flush(struct ipc_connection *conn);
+static void ipc_connection_flush_deferred(void *context);
+static void ipc_connection_write_ready(void *context);
+static void ipc_connection_dispatch_callback(struct ipc_connection *conn, ipc_object_t result, struct ipc_pending_call *call, const struct ipc_frame_header *header);
+static void ipc_connection_send_failed(struct ipc_connection *conn, uint64_t id, uint64_t flags);
+static void ipc_connection_sched_flush(struct ipc_connection *conn);
+static void ipc_connection_flush_batch(struct ipc_connection *conn);
+static void ipc_connection_on_reader(struct ipc_connection *conn, dispatch_block_t block);
+static bool ipc_connection_reader_busy(struct ipc_connection *conn);
+static void ipc_connection_retain(struct ipc_connection *conn);
+static void ipc_connection_release(struct ipc_connection *conn);
+static void ipc_connection_drop_queued(struct ipc_connection *conn);
+static struct ipc_pending_call *ipc_connection_pending_alloc(struct ipc_connection *conn);
+static void ipc_connection_pending_insert(struct ipc_connection *conn, struct ipc_pending_call *call, uint64_t timeout);
+static struct ipc_pending_call *ipc_connection_pending_remove(struct ipc_connection *conn, uint64_t id);
+static void ipc_connection_pending_fail_all(struct ipc_connection *conn);
+static void ipc_connection_reap_idle(void *context);
+static void ipc_connection_create_shards(struct ipc_connection *conn);
+static void ipc_connection_create_workers(struct ipc_connection *conn);
+static void ipc_connection_enqueue_send(struct ipc_connection *conn, ipc_object_t message, uint64_t id, uint64_t flags, uint64_t deadline);
+static uint64_t ipc_connection_call(struct ipc_connection *conn, ipc_object_t message, dispatch_queue_t targetq, uint64_t timeout,
+									ipc_handler_t handler, void *context, ipc_handler_function_t function);
+static void ipc_connection_invoke(ipc_handler_t handler, ipc_handler_function_t function, void *ctx, ipc_object_t result, int context);
+static void ipc_connection_notify(struct ipc_connection *conn, ipc_object_t object);
+static void ipc_connection_async_f(struct ipc_connection *conn, dispatch_queue_t queue, void *context, dispatch_function_t function);
+static void ipc_connection_async(struct ipc_connection *conn, dispatch_queue_t queue, dispatch_block_t block);
+
+/* Set on every queue a socket is read on, to its own queue */
+static char ipc_reader_key;
 
 ipc_connection_t ipc_connection_create(dispatch_queue_t targetq)
 {
@@ -37,15 +67,35 @@ ipc_connection_t ipc_connection_create(dispatch_queue_t targetq)
 	}
 
 	memset(conn, 0, sizeof(struct ipc_connection));
+	if ((conn->xc_pending = calloc(IPC_PENDING_BUCKETS, sizeof(struct ipc_pending_call *))) == NULL)
+	{
+		free(conn);
+		errno = ENOMEM;
+		return (NULL);
+	}
+
+	conn->xc_pending_buckets = IPC_PENDING_BUCKETS;
 	conn->xc_last_id = 1;
-	TAILQ_INIT(&conn->xc_peers);
-	TAILQ_INIT(&conn->xc_pending);
+	atomic_init(&conn->xc_refcount, 1);
+	pthread_mutex_init(&conn->xc_peers_lock, NULL);
+	pthread_mutex_init(&conn->xc_pending_lock, NULL);
+	pthread_mutex_init(&conn->xc_ops_lock, NULL);
+	pthread_mutex_init(&conn->xc_sched_lock, NULL);
+	pthread_mutex_init(&conn->xc_worker_lock, NULL);
+	TAILQ_INIT(&conn->xc_sched_active);
+	TAILQ_INIT(&conn->xc_worker_ready);
+	conn->xc_weight = 1;
+	conn->xc_listen_backlog = IPC_LISTEN_BACKLOG;
+	conn->xc_send_limit = IPC_SEND_QUEUE_LIMIT;
+	conn->xc_recv_limit = IPC_RECV_INFLIGHT_LIMIT;
+	conn->xc_recv_byte_limit = IPC_RECV_INFLIGHT_BYTES;
 
 	asprintf(&qname, "net.ymlab.ipc.connection.sendq.%p", conn);
 	conn->xc_send_queue = dispatch_queue_create(qname, NULL);
 
 	asprintf(&qname, "net.ymlab.ipc.connection.recvq.%p", conn);
 	conn->xc_recv_queue = dispatch_queue_create(qname, NULL);
+	dispatch_queue_set_specific(conn->xc_recv_queue, &ipc_reader_key, conn->xc_recv_queue, NULL);
 
 	free(qname);
 
@@ -116,6 +166,52 @@ ipc_connection_t ipc_connection_create_socket_service(const char *ip, uint16_t p
 	return ((ipc_connection_t)conn);
 }
 
+ipc_connection_t ipc_connection_create_shm_service(const char *path, dispatch_queue_t targetq, uint64_t flags)
+{
+	struct ipc_frame_header header;
+	struct ipc_shm *shm;
+	int fd;
+
+	struct ipc_connection *conn = (struct ipc_connection *)ipc_connection_create_domain_socket_service(path, targetq, flags);
+	if (conn == NULL)
+	{
+		return (NULL);
+	}
+
+	conn->xc_flags |= _IPC_CONNECTION_SHM;
+
+	if (flags & IPC_CONNECTION_LISTENER)
+	{
+		return ((ipc_connection_t)conn);
+	}
+
+	/* Without the rings the connection simply stays on the socket */
+	if (shm_create(SHM_RING_SIZE, &fd, &shm) != 0)
+	{
+		debugf("Cannot create shared memory: %s", strerror(errno));
+		return ((ipc_connection_t)conn);
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.version = IPC_PROTOCOL_VERSION;
+	header.flags = IPC_FRAME_SHM_SETUP;
+	header.nfds = 1;
+
+	if (unix_send_fds(conn->xc_local_port, &header, sizeof(header), &fd, 1) != 0)
+	{
+		debugf("Cannot send shared memory: %s", strerror(errno));
+		shm_release(shm);
+		close(fd);
+		return ((ipc_connection_t)conn);
+	}
+
+	close(fd);
+	conn->xc_shm_rx = shm;
+	conn->xc_shm_tx = shm;
+
+	return ((ipc_connection_t)conn);
+}
+
 void ipc_connection_set_target_queue(ipc_connection_t xconn, dispatch_queue_t targetq)
 {
 	struct ipc_connection *conn;
@@ -134,6 +230,24 @@ void ipc_connection_set_event_handler(ipc_connection_t xconn, ipc_handler_t hand
 	conn->xc_handler = (ipc_handler_t)Block_copy(handler);
 }
 
+void ipc_connection_set_event_handler_f(ipc_connection_t xconn, ipc_handler_function_t handler)
+{
+	struct ipc_connection *conn;
+
+	/* Called with the connection's context, see ipc_connection_set_context() */
+	debugf("connection=%p", xconn);
+	conn = (struct ipc_connection *)xconn;
+	conn->xc_handler_f = handler;
+}
+
+void ipc_connection_set_finalizer_f(ipc_connection_t xconn, ipc_finalizer_t finalizer)
+{
+	struct ipc_connection *conn;
+
+	conn = (struct ipc_connection *)xconn;
+	conn->xc_finalizer = finalizer;
+}
+
 void ipc_connection_suspend(ipc_connection_t xconn)
 {
 	struct ipc_connection *conn;
@@ -151,6 +265,8 @@ void ipc_connection_resume(ipc_connection_t xconn)
 
 	if (conn->xc_flags & IPC_CONNECTION_LISTENER)
 	{
+		ipc_connection_create_shards(conn);
+		ipc_connection_create_workers(conn);
 		conn->xc_recv_source = unix_create_server_source(conn->xc_local_port, conn, conn->xc_recv_queue);
 		dispatch_resume(conn->xc_recv_source);
 	}
@@ -163,233 +279,2947 @@ void ipc_connection_resume(ipc_connection_t xconn)
 		}
 	}
 
+	conn->xc_resumed = true;
 	dispatch_resume(conn->xc_recv_queue);
 }
 
 void ipc_connection_send_message(ipc_connection_t xconn, ipc_object_t message)
+{
+	ipc_connection_send_message_with_priority(xconn, message, IPC_PRIORITY_DEFAULT);
+}
+
+void ipc_connection_send_message_with_priority(ipc_connection_t xconn, ipc_object_t message, int priority)
 {
 
 	uint64_t id = 0;
+	uint64_t flags = (priority == IPC_PRIORITY_HIGH) ? IPC_FRAME_HIGH : 0;
+	struct ipc_object *xo = message;
 
 	struct ipc_connection *conn = (struct ipc_connection *)xconn;
-	if (ipc_get_type(message) == IPC_TYPE_DICTIONARY)
+	if (ipc_get_type(message) == IPC_TYPE_DICTIONARY && (xo->xo_flags & _IPC_REPLY))
 	{
-		id = ipc_dictionary_get_uint64(message, IPC_SEQID);
+		id = xo->xo_dict.xd_id;
 	}
 
+	/* A reply reuses the id of the call, which lives in the peer's id space */
 	if (id == 0)
 	{
 		id = (uint64_t)IPC_CONNECTION_NEXT_ID(conn);
 	}
+	else
+	{
+		flags |= IPC_FRAME_REPLY;
+	}
 
-	ipc_retain(message);
-	dispatch_async(conn->xc_send_queue, ^{
-	  ipc_send(xconn, message, id);
-	  ipc_release(message);
-	});
+	ipc_connection_enqueue_send(conn, message, id, flags, 0);
 }
 
-void ipc_connection_send_message_with_reply(ipc_connection_t xconn, ipc_object_t message, dispatch_queue_t targetq, ipc_handler_t handler)
+uint64_t ipc_connection_send_message_with_reply(ipc_connection_t xconn, ipc_object_t message, dispatch_queue_t targetq, ipc_handler_t handler)
+{
+	struct ipc_connection *conn = (struct ipc_connection *)xconn;
+
+	return (ipc_connection_send_message_with_reply_timeout(xconn, message, targetq, conn->xc_reply_timeout, handler));
+}
+
+uint64_t ipc_connection_send_message_with_reply_timeout(ipc_connection_t xconn, ipc_object_t message, dispatch_queue_t targetq, uint64_t timeout, ipc_handler_t handler)
+{
+	return (ipc_connection_call((struct ipc_connection *)xconn, message, targetq, timeout, handler, NULL, NULL));
+}
+
+uint64_t ipc_connection_send_message_with_reply_timeout_f(ipc_connection_t xconn, ipc_object_t message, dispatch_queue_t targetq, uint64_t timeout, void *context,
+													   ipc_handler_function_t handler)
+{
+	return (ipc_connection_call((struct ipc_connection *)xconn, message, targetq, timeout, NULL, context, handler));
+}
+
+uint64_t ipc_connection_send_message_with_reply_f(ipc_connection_t xconn, ipc_object_t message, dispatch_queue_t targetq, void *context, ipc_handler_function_t handler)
+{
+	struct ipc_connection *conn = (struct ipc_connection *)xconn;
+
+	return (ipc_connection_call(conn, message, targetq, conn->xc_reply_timeout, NULL, context, handler));
+}
+
+static uint64_t ipc_connection_call(struct ipc_connection *conn, ipc_object_t message, dispatch_queue_t targetq, uint64_t timeout,
+									ipc_handler_t handler, void *context, ipc_handler_function_t function)
 {
-	struct ipc_connection *conn;
 	struct ipc_pending_call *call;
+	uint64_t id;
 
-	conn = (struct ipc_connection *)xconn;
-	call = malloc(sizeof(struct ipc_pending_call));
-	call->xp_id = (uint64_t)IPC_CONNECTION_NEXT_ID(conn);
-	call->xp_handler = handler;
+	if ((call = ipc_connection_pending_alloc(conn)) == NULL)
+	{
+		ipc_object_t error = ipc_error_create(IPC_ERROR_CONNECTION_INVALID);
+		debugf("cannot allocate pending call");
+		ipc_connection_async(conn, targetq ?: conn->xc_target_queue, ^{
+		  ipc_connection_invoke(handler, function, context, error, IPC_HANDLER_CONTEXT_QUEUE);
+		  ipc_release(error);
+		});
+		return (0);
+	}
+
+	id = (uint64_t)IPC_CONNECTION_NEXT_ID(conn);
+	call->xp_id = id;
+	call->xp_handler = handler ? (ipc_handler_t)Block_copy(handler) : NULL;
+	call->xp_function = function;
+	call->xp_context = context;
 	call->xp_queue = targetq ?: conn->xc_target_queue;
-	TAILQ_INSERT_TAIL(&conn->xc_pending, call, xp_link);
+	ipc_connection_pending_insert(conn, call, timeout);
 
-	ipc_retain(message);
-	dispatch_async(conn->xc_send_queue, ^{
-	  ipc_send(xconn, message, call->xp_id);
-	  ipc_release(message);
-	});
+	/* The peer can skip the call once this caller has stopped waiting for it */
+	ipc_connection_enqueue_send(conn, message, id, 0, timeout > 0 ? ipc_monotonic_time() + timeout : 0);
+
+	return (id);
 }
 
-ipc_object_t ipc_connection_send_message_with_reply_sync(ipc_connection_t conn, ipc_object_t message)
+ipc_object_t ipc_connection_send_message_with_reply_sync(ipc_connection_t xconn, ipc_object_t message)
 {
-	__block ipc_object_t result;
-	dispatch_semaphore_t sem = dispatch_semaphore_create(0);
+	struct ipc_connection *conn = (struct ipc_connection *)xconn;
+	struct ipc_sync_waiter waiter;
+	struct ipc_pending_call *call;
+	int state = IPC_SYNC_PENDING;
+	uint64_t id, deadline;
+	unsigned int spins;
+
+	/* The reply would arrive through the reader this thread is holding */
+	if (ipc_connection_reader_busy(conn))
+	{
+		debugf("synchronous call from a handler on the connection's reader");
+		errno = EDEADLK;
+		return (ipc_error_create(IPC_ERROR_CONNECTION_INVALID));
+	}
 
-	ipc_connection_send_message_with_reply(conn, message, NULL, ^(ipc_object_t o) {
-	  result = o;
-	  dispatch_semaphore_signal(sem);
+	if ((call = ipc_connection_pending_alloc(conn)) == NULL)
+	{
+		return (ipc_error_create(IPC_ERROR_CONNECTION_INVALID));
+	}
+
+	memset(&waiter, 0, sizeof(waiter));
+	atomic_init(&waiter.sw_state, IPC_SYNC_PENDING);
+	waiter.sw_sem = dispatch_semaphore_create(0);
+
+	/* The reader hands the reply straight to this thread, no reply queue in between */
+	id = (uint64_t)IPC_CONNECTION_NEXT_ID(conn);
+	call->xp_id = id;
+	call->xp_waiter = &waiter;
+	ipc_connection_pending_insert(conn, call, conn->xc_reply_timeout);
+	deadline = conn->xc_reply_timeout > 0 ? ipc_monotonic_time() + conn->xc_reply_timeout : 0;
+
+	/* dispatch_sync runs the block on this thread: encode and write without a hop */
+	dispatch_sync(conn->xc_send_queue, ^{
+	  ipc_send(xconn, message, id, 0, deadline);
+	  if (conn->xc_flush_pending)
+	  {
+		  conn->xc_flush_pending = false;
+		  ipc_connection_flush(conn);
+	  }
 	});
 
-	dispatch_semaphore_wait(sem, DISPATCH_TIME_FOREVER);
-	return (result);
+	/* Loopback replies often land within microseconds, sleeping would cost more */
+	for (spins = 0; spins < IPC_SYNC_SPIN && atomic_load_explicit(&waiter.sw_state, memory_order_acquire) == IPC_SYNC_PENDING; spins++)
+		IPC_CPU_RELAX();
+
+	if (atomic_compare_exchange_strong(&waiter.sw_state, &state, IPC_SYNC_SLEEPING))
+	{
+		dispatch_semaphore_wait(waiter.sw_sem, DISPATCH_TIME_FOREVER);
+	}
+
+	dispatch_release(waiter.sw_sem);
+	return (waiter.sw_result);
 }
 
-void ipc_connection_send_barrier(ipc_connection_t xconn, dispatch_block_t barrier)
+int ipc_connection_try_send_message(ipc_connection_t xconn, ipc_object_t message)
 {
-	struct ipc_connection *conn;
+	struct ipc_connection *conn = (struct ipc_connection *)xconn;
 
-	conn = (struct ipc_connection *)xconn;
-	dispatch_sync(conn->xc_send_queue, barrier);
+	/* Refused while the outbound queue sits above the high watermark */
+	if (conn->xc_send_high > 0 && conn->xc_send_queued >= conn->xc_send_high)
+	{
+		errno = EWOULDBLOCK;
+		return (-1);
+	}
+
+	ipc_connection_send_message(xconn, message);
+	return (0);
 }
 
-void ipc_connection_cancel(ipc_connection_t xconn)
+void ipc_connection_send_barrier(ipc_connection_t xconn, dispatch_block_t barrier)
 {
 	struct ipc_connection *conn;
 
 	conn = (struct ipc_connection *)xconn;
-	dispatch_source_cancel(conn->xc_recv_source);
+	dispatch_sync(conn->xc_send_queue, ^{
+	  ipc_connection_flush(conn);
+	  barrier();
+	});
 }
 
-void ipc_connection_set_context(ipc_connection_t xconn, void *ctx)
+void ipc_connection_set_listen_backlog(ipc_connection_t xconn, int backlog)
 {
 	struct ipc_connection *conn;
 
 	conn = (struct ipc_connection *)xconn;
-	conn->xc_context = ctx;
+	if ((conn->xc_flags & IPC_CONNECTION_LISTENER) == 0 || backlog <= 0)
+	{
+		return;
+	}
+
+	if (unix_set_backlog(conn->xc_local_port, backlog) == 0)
+	{
+		pthread_mutex_lock(&conn->xc_peers_lock);
+		conn->xc_listen_backlog = backlog;
+		pthread_mutex_unlock(&conn->xc_peers_lock);
+	}
 }
 
-void *ipc_connection_get_context(ipc_connection_t xconn)
+void ipc_connection_get_listener_statistics(ipc_connection_t xconn, struct ipc_listener_statistics *stats)
 {
 	struct ipc_connection *conn;
 
 	conn = (struct ipc_connection *)xconn;
-	return (conn->xc_context);
+	pthread_mutex_lock(&conn->xc_peers_lock);
+	*stats = conn->xc_listener_stats;
+	pthread_mutex_unlock(&conn->xc_peers_lock);
 }
 
-static void ipc_send(ipc_connection_t xconn, ipc_object_t message, uint64_t id)
+void ipc_connection_set_listener_shards(ipc_connection_t xconn, unsigned int shards)
 {
 	struct ipc_connection *conn;
-	debugf("connection=%p, message=%p, id=%llu", xconn, message, id);
+
 	conn = (struct ipc_connection *)xconn;
-	if (ipc_pipe_send(message, id, conn->xc_local_port) != 0)
+	if ((conn->xc_flags & IPC_CONNECTION_LISTENER) == 0 || conn->xc_recv_source != NULL)
 	{
-		debugf("send failed: %s", strerror(errno));
-        ipc_object_t error = ipc_error_create(IPC_ERROR_CONNECTION_INVALID);
-		ipc_connection_dispatch_callback(conn, error, id);
-        ipc_release(error);
+		debugf("shards can only be set on a listener before it is resumed");
+		return;
 	}
-}
 
-struct ipc_connection *ipc_connection_get_peer(void *context, ipc_port_t port)
-{
-	struct ipc_connection *conn = context;
-	struct ipc_connection *peer;
+	/* One fair scheduler per listener would serialise every shard again */
+	if (conn->xc_fair)
+	{
+		debugf("shards cannot be combined with fair queueing");
+		return;
+	}
 
-	TAILQ_FOREACH(peer, &conn->xc_peers, xc_link)
+	if (shards == 0)
 	{
-		if (unix_port_compare(port, peer->xc_local_port))
-		{
-			return (peer);
-		}
+		shards = (unsigned int)MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
 	}
 
-	return (NULL);
+	conn->xc_shard_count = shards;
 }
 
-void *ipc_connection_new_peer(void *context, ipc_port_t local, dispatch_source_t src)
+void ipc_connection_set_listener_workers(ipc_connection_t xconn, unsigned int width)
 {
+	struct ipc_connection *conn;
 
-	struct ipc_connection *conn = context;
-	struct ipc_connection *peer = (struct ipc_connection *)ipc_connection_create(conn->xc_target_queue);
-	peer->xc_parent = conn;
-	peer->xc_local_port = local;
-	peer->xc_recv_source = src;
-
-	TAILQ_INSERT_TAIL(&conn->xc_peers, peer, xc_link);
+	conn = (struct ipc_connection *)xconn;
+	if ((conn->xc_flags & IPC_CONNECTION_LISTENER) == 0 || conn->xc_recv_source != NULL)
+	{
+		debugf("workers can only be set on a listener before it is resumed");
+		return;
+	}
 
-	if (src)
+	if (width == 0)
 	{
-		dispatch_set_context(src, peer);
-		dispatch_resume(src);
-		dispatch_async(conn->xc_target_queue, ^{
-		  conn->xc_handler(peer);
-		});
+		width = (unsigned int)MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
 	}
 
-	return (peer);
+	conn->xc_worker_count = width;
 }
 
-void ipc_connection_destroy_peer(void *context)
+void ipc_connection_set_listener_fair_queueing(ipc_connection_t xconn, bool enable)
 {
-	struct ipc_connection *conn, *parent;
-
-	conn = context;
-	parent = conn->xc_parent;
+	struct ipc_connection *conn;
 
-	if (conn->xc_parent != NULL)
+	conn = (struct ipc_connection *)xconn;
+	if ((conn->xc_flags & IPC_CONNECTION_LISTENER) == 0 || conn->xc_recv_source != NULL)
 	{
-		dispatch_async(parent->xc_target_queue, ^{
-            ipc_object_t error = ipc_error_create(IPC_ERROR_CONNECTION_INVALID);
-		    conn->xc_handler(error);
-            ipc_release(error);
-		});
-
-		TAILQ_REMOVE(&parent->xc_peers, conn, xc_link);
+		debugf("fair queueing can only be set on a listener before it is resumed");
+		return;
 	}
-	else
+
+	if (enable && conn->xc_shard_count > 1)
 	{
-		dispatch_async(conn->xc_target_queue, ^{
-            ipc_object_t error = ipc_error_create(IPC_ERROR_CONNECTION_INVALID);
-            conn->xc_handler(error);
-            ipc_release(error);
-		});
+		debugf("fair queueing cannot be combined with shards");
+		return;
 	}
 
-	dispatch_release(conn->xc_recv_source);
+	conn->xc_fair = enable;
 }
 
-static void ipc_connection_dispatch_callback(struct ipc_connection *conn, ipc_object_t result, uint64_t id)
+/*
+ * One coarse timer per listener walks the peer table; peers only stamp
+ * the time of their last read or write. A peer is reaped between one and
+ * one and a half timeouts after it went quiet.
+ */
+void ipc_connection_set_idle_timeout(ipc_connection_t xconn, uint64_t timeout)
 {
-	struct ipc_pending_call *call;
-	TAILQ_FOREACH(call, &conn->xc_pending, xp_link)
+	struct ipc_connection *conn;
+	uint64_t interval = MAX(timeout / 2, IPC_REAP_INTERVAL_MIN);
+
+	conn = (struct ipc_connection *)xconn;
+	if ((conn->xc_flags & IPC_CONNECTION_LISTENER) == 0)
 	{
-		if (call->xp_id == id)
-		{
-			ipc_retain(result);
-			dispatch_async(call->xp_queue, ^{
-			  call->xp_handler(result);
-			  ipc_release(result);
-			  TAILQ_REMOVE(&conn->xc_pending, call,
-						   xp_link);
-			  free(call);
-			});
-			return;
-		}
+		return;
 	}
 
-	if (conn->xc_handler)
+	pthread_mutex_lock(&conn->xc_peers_lock);
+	conn->xc_idle_timeout = timeout;
+	if (conn->xc_reap_source == NULL && timeout > 0)
 	{
-		ipc_retain(result);
-		dispatch_async(conn->xc_target_queue, ^{
-		  debugf("calling handler=%p", conn->xc_handler);
-		  conn->xc_handler(result);
-		  ipc_release(result);
-		});
+		conn->xc_reap_source = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0,
+													  dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0));
+		dispatch_set_context(conn->xc_reap_source, conn);
+		dispatch_source_set_event_handler_f(conn->xc_reap_source, ipc_connection_reap_idle);
+		dispatch_source_set_timer(conn->xc_reap_source, DISPATCH_TIME_FOREVER, 0, 0);
+		dispatch_resume(conn->xc_reap_source);
+	}
+
+	if (conn->xc_reap_source != NULL)
+	{
+		dispatch_source_set_timer(conn->xc_reap_source,
+								  timeout > 0 ? dispatch_time(DISPATCH_TIME_NOW, (int64_t)interval) : DISPATCH_TIME_FOREVER,
+								  interval, interval / 2);
 	}
+	pthread_mutex_unlock(&conn->xc_peers_lock);
 }
 
-void ipc_connection_recv_message(void *context)
+void ipc_connection_set_max_peers(ipc_connection_t xconn, size_t max_peers)
 {
+	struct ipc_connection *conn;
 
-	debugf("connection=%p", context);
-
-	ipc_object_t result;
-	uint64_t id;
-
-	struct ipc_connection *conn = context;
-	size_t err = ipc_pipe_receive(conn->xc_local_port, &result, &id);
-
-	if (err < 0)
+	conn = (struct ipc_connection *)xconn;
+	if ((conn->xc_flags & IPC_CONNECTION_LISTENER) == 0)
 	{
 		return;
 	}
 
-	if (err == 0)
-	{
-		dispatch_source_cancel(conn->xc_recv_source);
-		return;
-	}
+	pthread_mutex_lock(&conn->xc_peers_lock);
+	conn->xc_max_peers = max_peers;
+	pthread_mutex_unlock(&conn->xc_peers_lock);
+}
+
+void ipc_connection_set_weight(ipc_connection_t xconn, unsigned int weight)
+{
+	struct ipc_connection *conn;
+
+	conn = (struct ipc_connection *)xconn;
+	conn->xc_weight = MAX(weight, 1);
+}
+
+size_t ipc_connection_get_queue_depth(ipc_connection_t xconn)
+{
+	struct ipc_connection *conn;
+
+	/* Messages decoded but not yet returned from the handler, queued or running */
+	conn = (struct ipc_connection *)xconn;
+	return (atomic_load(&conn->xc_recv_inflight));
+}
+
+void ipc_connection_set_send_watermarks(ipc_connection_t xconn, size_t low, size_t high, size_t limit)
+{
+	struct ipc_connection *conn;
+
+	conn = (struct ipc_connection *)xconn;
+	dispatch_sync(conn->xc_send_queue, ^{
+	  conn->xc_send_low = MIN(low, high);
+	  conn->xc_send_high = high;
+	  conn->xc_send_limit = limit;
+	});
+}
+
+static void ipc_connection_set_watermark(struct ipc_connection *conn, ipc_watermark_handler_t copy, ipc_watermark_function_t function)
+{
+	dispatch_sync(conn->xc_send_queue, ^{
+	  if (conn->xc_watermark_handler)
+		  Block_release(conn->xc_watermark_handler);
+	  conn->xc_watermark_handler = copy;
+	  conn->xc_watermark_handler_f = function;
+	});
+}
+
+void ipc_connection_set_watermark_handler(ipc_connection_t xconn, ipc_watermark_handler_t handler)
+{
+	ipc_watermark_handler_t copy = handler ? (ipc_watermark_handler_t)Block_copy(handler) : NULL;
+
+	ipc_connection_set_watermark((struct ipc_connection *)xconn, copy, NULL);
+}
+
+void ipc_connection_set_watermark_handler_f(ipc_connection_t xconn, ipc_watermark_function_t handler)
+{
+	/* Called with the connection's context, see ipc_connection_set_context() */
+	ipc_connection_set_watermark((struct ipc_connection *)xconn, NULL, handler);
+}
+
+static void ipc_connection_set_batch(struct ipc_connection *conn, size_t max_batch, ipc_batch_handler_t copy, ipc_batch_handler_function_t function)
+{
+	size_t max = max_batch ? max_batch : IPC_RECV_BATCH_MAX;
+
+	debugf("connection=%p", conn);
+
+	/* A batch already collected goes to the old handler, at the size it was allocated for */
+	ipc_connection_on_reader(conn, ^{
+	  ipc_connection_flush_batch(conn);
+	  if (conn->xc_batch_handler)
+		  Block_release(conn->xc_batch_handler);
+	  conn->xc_batch_handler = copy;
+	  conn->xc_batch_handler_f = function;
+	  conn->xc_recv_batch_max = max;
+	});
+}
+
+void ipc_connection_set_batch_event_handler(ipc_connection_t xconn, size_t max_batch, ipc_batch_handler_t handler)
+{
+	ipc_batch_handler_t copy = handler ? (ipc_batch_handler_t)Block_copy(handler) : NULL;
+
+	ipc_connection_set_batch((struct ipc_connection *)xconn, max_batch, copy, NULL);
+}
+
+void ipc_connection_set_batch_event_handler_f(ipc_connection_t xconn, size_t max_batch, ipc_batch_handler_function_t handler)
+{
+	/* Called with the connection's context, see ipc_connection_set_context() */
+	ipc_connection_set_batch((struct ipc_connection *)xconn, max_batch, NULL, handler);
+}
+
+void ipc_connection_set_inline_delivery(ipc_connection_t xconn, bool enable)
+{
+	struct ipc_connection *conn;
+
+	/* Handlers then run on the reading thread and must be short and thread-safe */
+	conn = (struct ipc_connection *)xconn;
+	conn->xc_inline_delivery = enable;
+}
+
+void ipc_connection_set_reply_timeout(ipc_connection_t xconn, uint64_t timeout)
+{
+	struct ipc_connection *conn;
+
+	/* Nanoseconds, zero waits forever; a listener hands the timeout to new peers */
+	conn = (struct ipc_connection *)xconn;
+	conn->xc_reply_timeout = timeout;
+}
+
+void ipc_connection_set_recv_limit(ipc_connection_t xconn, size_t messages, size_t bytes)
+{
+	struct ipc_connection *conn;
+
+	/* Zero disables the respective limit; a listener hands its limits to new peers */
+	conn = (struct ipc_connection *)xconn;
+	conn->xc_recv_limit = messages;
+	conn->xc_recv_byte_limit = bytes;
+}
+
+void ipc_connection_set_send_coalescing(ipc_connection_t xconn, uint64_t latency, size_t max_bytes)
+{
+	struct ipc_connection *conn;
+
+	conn = (struct ipc_connection *)xconn;
+	dispatch_sync(conn->xc_send_queue, ^{
+	  conn->xc_coalesce_latency = latency;
+	  conn->xc_coalesce_max = max_bytes;
+	  if (max_bytes == 0)
+		  ipc_connection_flush(conn);
+	});
+}
+
+void ipc_connection_get_statistics(ipc_connection_t xconn, struct ipc_connection_statistics *stats)
+{
+	struct ipc_connection *conn;
+
+	conn = (struct ipc_connection *)xconn;
+	dispatch_sync(conn->xc_send_queue, ^{
+	  *stats = conn->xc_stats;
+	});
+}
+
+void ipc_connection_cancel_reply(ipc_connection_t xconn, uint64_t id)
+{
+	struct ipc_connection *conn = (struct ipc_connection *)xconn;
+	struct ipc_pending_call *call;
+	ipc_object_t error;
+
+	/* Already answered, timed out or cancelled */
+	if (id == 0 || (call = ipc_connection_pending_remove(conn, id)) == NULL)
+	{
+		return;
+	}
+
+	error = ipc_error_create(IPC_ERROR_CANCELLED);
+	ipc_connection_dispatch_callback(conn, error, call, NULL);
+	ipc_release(error);
+
+	/* Tell the peer, so it can skip or abort the work */
+	ipc_connection_enqueue_send(conn, NULL, id, IPC_FRAME_CANCEL, 0);
+}
+
+/*
+ * Cancelled call ids are remembered in a small table indexed by id; an
+ * entry overwritten by a newer cancellation only means the work is done.
+ */
+bool ipc_connection_call_cancelled(ipc_connection_t xconn, ipc_object_t message)
+{
+	struct ipc_connection *conn = (struct ipc_connection *)xconn;
+	struct ipc_object *xo = message;
+	uint64_t id;
+
+	if (ipc_get_type(message) != IPC_TYPE_DICTIONARY || (id = xo->xo_dict.xd_id) == 0)
+	{
+		return (false);
+	}
+
+	return (atomic_load_explicit(&conn->xc_cancelled[id & (IPC_CANCEL_SLOTS - 1)], memory_order_relaxed) == id);
+}
+
+void ipc_connection_cancel(ipc_connection_t xconn)
+{
+	struct ipc_connection *conn;
+
+	conn = (struct ipc_connection *)xconn;
+	dispatch_source_cancel(conn->xc_recv_source);
+}
+
+void ipc_connection_set_context(ipc_connection_t xconn, void *ctx)
+{
+	struct ipc_connection *conn;
+
+	conn = (struct ipc_connection *)xconn;
+	conn->xc_context = ctx;
+}
+
+void *ipc_connection_get_context(ipc_connection_t xconn)
+{
+	struct ipc_connection *conn;
+
+	conn = (struct ipc_connection *)xconn;
+	return (conn->xc_context);
+}
+
+static void ipc_connection_send_failed(struct ipc_connection *conn, uint64_t id, uint64_t flags)
+{
+	ipc_object_t error = ipc_error_create(IPC_ERROR_CONNECTION_INVALID);
+
+	struct ipc_pending_call *call = NULL;
+
+	/* A failed call is answered through its own reply handler */
+	if ((flags & IPC_FRAME_REPLY) == 0)
+	{
+		call = ipc_connection_pending_remove(conn, id);
+	}
+
+	ipc_connection_dispatch_callback(conn, error, call, NULL);
+	ipc_release(error);
+}
+
+/* A bulk frame's start is only known once it moves into the send buffer */
+static int ipc_connection_track(struct ipc_buffer *ids, uint64_t id, uint64_t flags, uint64_t deadline, size_t start, size_t end)
+{
+	struct ipc_send_record rec;
+
+	rec.xs_id = id;
+	rec.xs_flags = flags;
+	rec.xs_deadline = deadline;
+	rec.xs_start = start;
+	rec.xs_end = end;
+	return (ipc_buffer_append(ids, &rec, sizeof(rec)));
+}
+
+static void ipc_connection_retire(struct ipc_connection *conn)
+{
+	struct ipc_buffer *ids = &conn->xc_send_ids;
+	struct ipc_buffer *buf = &conn->xc_send_buffer;
+	struct ipc_send_record rec;
+
+	/* Frames the socket has taken whole cannot fail on this side any more */
+	while (ids->ib_offset < ids->ib_length)
+	{
+		memcpy(&rec, ids->ib_data + ids->ib_offset, sizeof(rec));
+		if (buf->ib_length != 0 && rec.xs_end > buf->ib_offset)
+		{
+			break;
+		}
+		ids->ib_offset += sizeof(rec);
+	}
+
+	if (ids->ib_offset == ids->ib_length)
+	{
+		ids->ib_offset = ids->ib_length = 0;
+	}
+}
+
+/*
+ * Fails every message still queued for the socket and closes the send
+ * side. Calls are answered through their reply handlers, the loss of
+ * anything else is reported to the event handler once.
+ */
+static void ipc_connection_send_abort(struct ipc_connection *conn)
+{
+	struct ipc_buffer *lists[] = { &conn->xc_send_ids, &conn->xc_bulk_ids };
+	struct ipc_pending_call *call;
+	struct ipc_send_record rec;
+	struct ipc_buffer *ids;
+	ipc_object_t error;
+	bool orphaned = false;
+	size_t i;
+
+	conn->xc_send_closed = true;
+	error = ipc_error_create(IPC_ERROR_CONNECTION_INVALID);
+
+	for (i = 0; i < sizeof(lists) / sizeof(lists[0]); i++)
+	{
+		ids = lists[i];
+		for (; ids->ib_offset < ids->ib_length; ids->ib_offset += sizeof(rec))
+		{
+			memcpy(&rec, ids->ib_data + ids->ib_offset, sizeof(rec));
+			call = NULL;
+			if ((rec.xs_flags & IPC_FRAME_REPLY) == 0)
+			{
+				call = ipc_connection_pending_remove(conn, rec.xs_id);
+			}
+
+			if (call != NULL)
+			{
+				ipc_connection_dispatch_callback(conn, error, call, NULL);
+			}
+			else
+			{
+				orphaned = true;
+			}
+		}
+	}
+
+	if (orphaned)
+	{
+		ipc_connection_dispatch_callback(conn, error, NULL, NULL);
+	}
+
+	ipc_release(error);
+	ipc_connection_drop_queued(conn);
+}
+
+static void ipc_send_shm(struct ipc_connection *conn, ipc_object_t message, uint64_t id, uint64_t flags, uint64_t deadline)
+{
+	struct ipc_frame_header header;
+	struct ipc_buffer *buf = &conn->xc_send_buffer;
+	struct ipc_buffer *ids = &conn->xc_send_ids;
+	size_t start;
+	bool wakeup;
+
+	/* Anything still batched for the socket goes first */
+	ipc_connection_flush(conn);
+
+	/* Room for the socket fallback's record, so nothing can fail once a sequence number is taken */
+	if (ipc_buffer_reserve(ids, ids->ib_length + sizeof(struct ipc_send_record)) != 0)
+	{
+		ipc_connection_send_failed(conn, id, flags);
+		return;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.id = id;
+	header.flags = flags;
+	header.spare[0] = ipc_deadline_to_wire(deadline);
+
+	/* A stalled socket may still hold queued bytes in front of the frame */
+	start = buf->ib_length;
+	if (ipc_pipe_pack(message, &header, buf, &conn->xc_send_fds) != 0)
+	{
+		ipc_connection_send_failed(conn, id, flags);
+		return;
+	}
+
+	/* A number taken for a frame that never went out would stall the receiver's ring */
+	header.seq = shm_next_seq(conn->xc_shm_tx);
+	memcpy(buf->ib_data + start, &header, sizeof(header));
+
+	conn->xc_stats.messages_sent++;
+
+	/* Descriptors only travel over the socket */
+	if (header.nfds > 0 || shm_push(conn->xc_shm_tx, buf->ib_data + start, buf->ib_length - start, &wakeup) != 0)
+	{
+		/* Ring full or frame too large: the sequence number keeps the socket copy in order */
+		ipc_connection_track(ids, id, flags, deadline, start, buf->ib_length);
+		conn->xc_batch_count++;
+		ipc_connection_flush(conn);
+		return;
+	}
+
+	buf->ib_length = start;
+
+	if (wakeup)
+	{
+		/* The doorbell queues behind whatever the socket has not taken yet */
+		memset(&header, 0, sizeof(header));
+		header.version = IPC_PROTOCOL_VERSION;
+		header.flags = IPC_FRAME_DOORBELL;
+
+		if (ipc_buffer_append(buf, &header, sizeof(header)) != 0)
+		{
+			debugf("doorbell failed: %s", strerror(errno));
+			ipc_connection_send_failed(conn, id, flags);
+			return;
+		}
+
+		ipc_connection_flush(conn);
+	}
+}
+
+static void ipc_send_control(struct ipc_connection *conn, uint64_t id, uint64_t flags)
+{
+	struct ipc_frame_header header;
+
+	if (conn->xc_send_closed)
+	{
+		return;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.version = IPC_PROTOCOL_VERSION;
+	header.id = id;
+	header.flags = flags;
+
+	/* Control frames go over the socket and ahead of any fragments still queued */
+	if (ipc_buffer_append(&conn->xc_send_buffer, &header, sizeof(header)) != 0)
+	{
+		debugf("control frame failed: %s", strerror(errno));
+		return;
+	}
+
+	ipc_connection_flush(conn);
+}
+
+static void ipc_send(ipc_connection_t xconn, ipc_object_t message, uint64_t id, uint64_t flags, uint64_t deadline)
+{
+	struct ipc_frame_header header;
+	struct ipc_connection *conn;
+	size_t start;
+	debugf("connection=%p, message=%p, id=%llu", xconn, message, id);
+	conn = (struct ipc_connection *)xconn;
+
+	if (conn->xc_send_closed)
+	{
+		ipc_connection_send_failed(conn, id, flags);
+		return;
+	}
+
+	if (conn->xc_shm_tx != NULL)
+	{
+		ipc_send_shm(conn, message, id, flags, deadline);
+		return;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.id = id;
+	header.flags = flags;
+	header.spare[0] = ipc_deadline_to_wire(deadline);
+
+	/* Default priority messages queue behind a large message still going out in pieces */
+	if ((flags & IPC_FRAME_HIGH) == 0 && conn->xc_bulk_buffer.ib_offset < conn->xc_bulk_buffer.ib_length)
+	{
+		start = conn->xc_bulk_buffer.ib_length;
+		if (ipc_pipe_pack(message, &header, &conn->xc_bulk_buffer, &conn->xc_bulk_fds) != 0)
+		{
+			ipc_connection_send_failed(conn, id, flags);
+			return;
+		}
+
+		if (ipc_connection_track(&conn->xc_bulk_ids, id, flags, deadline, 0, conn->xc_bulk_buffer.ib_length) != 0)
+		{
+			conn->xc_bulk_buffer.ib_length = start;
+			conn->xc_bulk_fds.ib_length -= (size_t)header.nfds * sizeof(int);
+			ipc_connection_send_failed(conn, id, flags);
+			return;
+		}
+
+		conn->xc_stats.messages_sent++;
+		ipc_connection_flush(conn);
+		return;
+	}
+
+	start = conn->xc_send_buffer.ib_length;
+	if (ipc_pipe_pack(message, &header, &conn->xc_send_buffer, &conn->xc_send_fds) != 0)
+	{
+		ipc_connection_send_failed(conn, id, flags);
+		return;
+	}
+
+	conn->xc_stats.messages_sent++;
+
+	/* A large message is fragmented so it cannot hold up high priority ones for its whole length */
+	if ((flags & IPC_FRAME_HIGH) == 0 && header.nfds == 0 && header.length > IPC_FRAGMENT_SIZE)
+	{
+		if (ipc_connection_track(&conn->xc_bulk_ids, id, flags, deadline, 0,
+								 conn->xc_bulk_buffer.ib_length + conn->xc_send_buffer.ib_length - start) != 0)
+		{
+			conn->xc_send_buffer.ib_length = start;
+			ipc_connection_send_failed(conn, id, flags);
+			return;
+		}
+
+		if (ipc_buffer_append(&conn->xc_bulk_buffer, conn->xc_send_buffer.ib_data + start,
+							  conn->xc_send_buffer.ib_length - start) != 0)
+		{
+			conn->xc_bulk_ids.ib_length -= sizeof(struct ipc_send_record);
+			conn->xc_send_buffer.ib_length = start;
+			ipc_connection_send_failed(conn, id, flags);
+			return;
+		}
+
+		conn->xc_send_buffer.ib_length = start;
+		ipc_connection_flush(conn);
+		return;
+	}
+
+	if (ipc_connection_track(&conn->xc_send_ids, id, flags, deadline, start, conn->xc_send_buffer.ib_length) != 0)
+	{
+		conn->xc_send_buffer.ib_length = start;
+		conn->xc_send_fds.ib_length -= (size_t)header.nfds * sizeof(int);
+		ipc_connection_send_failed(conn, id, flags);
+		return;
+	}
+
+	conn->xc_batch_count++;
+
+	/* A batch carries at most one frame's worth of descriptors */
+	if (header.nfds > 0 || conn->xc_coalesce_max == 0 ||
+		conn->xc_send_buffer.ib_length - conn->xc_send_buffer.ib_offset >= conn->xc_coalesce_max)
+	{
+		ipc_connection_flush(conn);
+		return;
+	}
+
+	/*
+	 * Coalescing: the first message of a batch schedules the flush, every
+	 * message queued behind it until then is appended to the same buffer.
+	 */
+	if (!conn->xc_flush_pending)
+	{
+		conn->xc_flush_pending = true;
+		ipc_connection_retain(conn);
+		if (conn->xc_coalesce_latency == 0)
+		{
+			dispatch_async_f(conn->xc_send_queue, conn, ipc_connection_flush_deferred);
+		}
+		else
+		{
+			dispatch_after_f(dispatch_time(DISPATCH_TIME_NOW, (int64_t)conn->xc_coalesce_latency),
+							 conn->xc_send_queue, conn, ipc_connection_flush_deferred);
+		}
+	}
+}
+
+static void ipc_connection_update_watermark(struct ipc_connection *conn)
+{
+	struct ipc_buffer *buf = &conn->xc_send_buffer;
+	ipc_watermark_handler_t handler = conn->xc_watermark_handler;
+	ipc_watermark_function_t function = conn->xc_watermark_handler_f;
+	void *ctx = conn->xc_context;
+	size_t queued = buf->ib_length - buf->ib_offset;
+
+	queued += conn->xc_bulk_buffer.ib_length - conn->xc_bulk_buffer.ib_offset;
+	bool above;
+
+	conn->xc_send_queued = queued;
+
+	if (conn->xc_send_high == 0)
+	{
+		return;
+	}
+
+	/* Hysteresis: report crossing the high mark once, and again when back under the low mark */
+	if (!conn->xc_send_above && queued >= conn->xc_send_high)
+	{
+		above = true;
+	}
+	else if (conn->xc_send_above && queued <= conn->xc_send_low)
+	{
+		above = false;
+	}
+	else
+	{
+		return;
+	}
+
+	conn->xc_send_above = above;
+	if (handler)
+	{
+		ipc_connection_async(conn, conn->xc_target_queue, ^{
+		  handler(above);
+		});
+	}
+	else if (function)
+	{
+		ipc_connection_async(conn, conn->xc_target_queue, ^{
+		  function(ctx, above);
+		});
+	}
+}
+
+static void ipc_connection_drop_queued(struct ipc_connection *conn)
+{
+	conn->xc_send_buffer.ib_offset = conn->xc_send_buffer.ib_length = 0;
+	conn->xc_send_fds.ib_offset = conn->xc_send_fds.ib_length = 0;
+	conn->xc_bulk_buffer.ib_offset = conn->xc_bulk_buffer.ib_length = 0;
+	conn->xc_bulk_fds.ib_offset = conn->xc_bulk_fds.ib_length = 0;
+	conn->xc_bulk_sent = 0;
+	conn->xc_send_ids.ib_offset = conn->xc_send_ids.ib_length = 0;
+	conn->xc_bulk_ids.ib_offset = conn->xc_bulk_ids.ib_length = 0;
+	ipc_connection_update_watermark(conn);
+}
+
+static void ipc_connection_arm_writer(struct ipc_connection *conn)
+{
+	if (conn->xc_send_armed)
+	{
+		return;
+	}
+
+	if (conn->xc_send_source == NULL)
+	{
+		conn->xc_send_source = dispatch_source_create(DISPATCH_SOURCE_TYPE_WRITE,
+													  (uintptr_t)conn->xc_local_port, 0, conn->xc_send_queue);
+		dispatch_set_context(conn->xc_send_source, conn);
+		dispatch_source_set_event_handler_f(conn->xc_send_source, ipc_connection_write_ready);
+	}
+
+	conn->xc_send_armed = true;
+	dispatch_resume(conn->xc_send_source);
+}
+
+static void ipc_connection_disarm_writer(struct ipc_connection *conn)
+{
+	if (!conn->xc_send_armed)
+	{
+		return;
+	}
+
+	conn->xc_send_armed = false;
+	dispatch_suspend(conn->xc_send_source);
+}
+
+static void ipc_connection_write_ready(void *context)
+{
+	struct ipc_connection *conn = context;
+
+	ipc_connection_disarm_writer(conn);
+	ipc_connection_flush(conn);
+}
+
+/*
+ * Moves queued bulk frames into the send buffer while it runs low. Frames
+ * up to IPC_FRAGMENT_SIZE, and frames carrying descriptors, move whole;
+ * larger ones go out as IPC_FRAGMENT_SIZE pieces under a copy of their
+ * header, the last one marked IPC_FRAME_FRAGMENT_END.
+ */
+static int ipc_connection_bulk_moved(struct ipc_connection *conn, size_t start)
+{
+	struct ipc_buffer *ids = &conn->xc_bulk_ids;
+	struct ipc_send_record rec;
+
+	if (ids->ib_offset == ids->ib_length)
+	{
+		return (0);
+	}
+
+	/* The frame is in the send buffer now, so its id follows it there */
+	memcpy(&rec, ids->ib_data + ids->ib_offset, sizeof(rec));
+	if (ipc_connection_track(&conn->xc_send_ids, rec.xs_id, rec.xs_flags, rec.xs_deadline, start,
+							 conn->xc_send_buffer.ib_length) != 0)
+	{
+		return (-1);
+	}
+
+	ids->ib_offset += sizeof(rec);
+	if (ids->ib_offset == ids->ib_length)
+	{
+		ids->ib_offset = ids->ib_length = 0;
+	}
+
+	return (0);
+}
+
+static int ipc_connection_feed_bulk(struct ipc_connection *conn)
+{
+	struct ipc_buffer *bulk = &conn->xc_bulk_buffer;
+	struct ipc_buffer *buf = &conn->xc_send_buffer;
+	struct ipc_frame_header header;
+	const char *frame;
+	size_t len, fdlen, start;
+
+	while (bulk->ib_offset < bulk->ib_length && buf->ib_length - buf->ib_offset < IPC_FRAGMENT_SIZE)
+	{
+		frame = bulk->ib_data + bulk->ib_offset;
+		memcpy(&header, frame, sizeof(header));
+
+		if (conn->xc_bulk_sent == 0 && (header.length <= IPC_FRAGMENT_SIZE || header.nfds > 0))
+		{
+			len = sizeof(header) + (size_t)header.length;
+			fdlen = (size_t)header.nfds * sizeof(int);
+			start = buf->ib_length;
+
+			if (ipc_buffer_append(buf, frame, len) != 0 ||
+				ipc_buffer_append(&conn->xc_send_fds, conn->xc_bulk_fds.ib_data + conn->xc_bulk_fds.ib_offset, fdlen) != 0)
+			{
+				return (-1);
+			}
+
+			bulk->ib_offset += len;
+			conn->xc_bulk_fds.ib_offset += fdlen;
+			if (ipc_connection_bulk_moved(conn, start) != 0)
+			{
+				return (-1);
+			}
+			continue;
+		}
+
+		len = MIN(IPC_FRAGMENT_SIZE, (size_t)header.length - conn->xc_bulk_sent);
+		if (ipc_buffer_reserve(buf, buf->ib_length + sizeof(header) + len) != 0)
+		{
+			return (-1);
+		}
+
+		header.flags |= IPC_FRAME_FRAGMENT;
+		if (conn->xc_bulk_sent + len == header.length)
+		{
+			header.flags |= IPC_FRAME_FRAGMENT_END;
+		}
+		header.length = len;
+		start = buf->ib_length;
+
+		memcpy(buf->ib_data + buf->ib_length, &header, sizeof(header));
+		memcpy(buf->ib_data + buf->ib_length + sizeof(header), frame + sizeof(header) + conn->xc_bulk_sent, len);
+		buf->ib_length += sizeof(header) + len;
+		conn->xc_bulk_sent += len;
+
+		if (header.flags & IPC_FRAME_FRAGMENT_END)
+		{
+			bulk->ib_offset += sizeof(header) + conn->xc_bulk_sent;
+			conn->xc_bulk_sent = 0;
+			if (ipc_connection_bulk_moved(conn, start) != 0)
+			{
+				return (-1);
+			}
+		}
+	}
+
+	if (bulk->ib_offset == bulk->ib_length)
+	{
+		bulk->ib_offset = bulk->ib_length = 0;
+		conn->xc_bulk_fds.ib_offset = conn->xc_bulk_fds.ib_length = 0;
+		if (bulk->ib_capacity > IPC_SEND_BUFFER_RETAIN_SIZE)
+		{
+			ipc_buffer_destroy(bulk);
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Bytes held for a peer, less the rest of the frame going out in
+ * fragments: that one is bounded by IPC_MAX_FRAME_SIZE at send time.
+ */
+static size_t ipc_connection_send_backlog(struct ipc_connection *conn)
+{
+	struct ipc_buffer *bulk = &conn->xc_bulk_buffer;
+	struct ipc_buffer *buf = &conn->xc_send_buffer;
+	struct ipc_frame_header header;
+	size_t queued;
+
+	queued = buf->ib_length - buf->ib_offset + bulk->ib_length - bulk->ib_offset;
+	if (bulk->ib_offset < bulk->ib_length)
+	{
+		memcpy(&header, bulk->ib_data + bulk->ib_offset, sizeof(header));
+		queued -= sizeof(header) + (size_t)header.length - conn->xc_bulk_sent;
+	}
+
+	return (queued);
+}
+
+/*
+ * The time left is stamped as a frame starts going out, not when it was
+ * packed, so time spent queued here is not charged to the receiver. Of a
+ * fragmented message only the last piece, which the receiver goes by,
+ * carries a record.
+ */
+static void ipc_connection_stamp(struct ipc_connection *conn)
+{
+	struct ipc_buffer *ids = &conn->xc_send_ids;
+	struct ipc_buffer *buf = &conn->xc_send_buffer;
+	struct ipc_frame_header header;
+	struct ipc_send_record rec;
+	size_t off;
+
+	for (off = ids->ib_offset; off < ids->ib_length; off += sizeof(rec))
+	{
+		memcpy(&rec, ids->ib_data + off, sizeof(rec));
+		if (rec.xs_deadline == 0 || rec.xs_start < buf->ib_offset)
+		{
+			continue;
+		}
+
+		memcpy(&header, buf->ib_data + rec.xs_start, sizeof(header));
+		header.spare[0] = ipc_deadline_to_wire(rec.xs_deadline);
+		memcpy(buf->ib_data + rec.xs_start, &header, sizeof(header));
+	}
+}
+
+static void ipc_connection_flush(struct ipc_connection *conn)
+{
+	struct ipc_buffer *buf = &conn->xc_send_buffer;
+	size_t batch = conn->xc_batch_count;
+	ssize_t sent;
+
+	if (ipc_connection_feed_bulk(conn) != 0)
+	{
+		debugf("cannot queue fragment: %s", strerror(errno));
+		ipc_connection_send_abort(conn);
+		return;
+	}
+
+	/* While the socket is full the write source resumes the flush */
+	if (buf->ib_offset < buf->ib_length && !conn->xc_send_armed)
+	{
+		conn->xc_batch_count = 0;
+		ipc_connection_stamp(conn);
+
+		if ((sent = ipc_pipe_write(conn->xc_local_port, buf, &conn->xc_send_fds)) < 0)
+		{
+			debugf("send failed: %s", strerror(errno));
+			ipc_connection_send_abort(conn);
+			return;
+		}
+
+		ipc_connection_retire(conn);
+
+		conn->xc_stats.bytes_sent += (uint64_t)sent;
+		if (conn->xc_parent != NULL && sent > 0)
+		{
+			atomic_store_explicit(&conn->xc_last_active, ipc_monotonic_time(), memory_order_relaxed);
+		}
+		conn->xc_stats.send_batches++;
+		if (batch > conn->xc_stats.max_batch_size)
+		{
+			conn->xc_stats.max_batch_size = batch;
+		}
+
+		if (buf->ib_offset < buf->ib_length)
+		{
+			ipc_connection_arm_writer(conn);
+		}
+	}
+
+	/* Fragments go out one flush at a time, so sends queued meanwhile get in between */
+	if (conn->xc_bulk_buffer.ib_offset < conn->xc_bulk_buffer.ib_length && !conn->xc_send_armed && !conn->xc_flush_pending)
+	{
+		conn->xc_flush_pending = true;
+		ipc_connection_retain(conn);
+		dispatch_async_f(conn->xc_send_queue, conn, ipc_connection_flush_deferred);
+	}
+
+	/* A peer that stopped reading does not get to hold unbounded memory */
+	if (conn->xc_send_limit > 0 && ipc_connection_send_backlog(conn) > conn->xc_send_limit)
+	{
+		debugf("send queue over limit, cancelling connection=%p", conn);
+		ipc_connection_send_abort(conn);
+		if (conn->xc_recv_source != NULL)
+		{
+			dispatch_source_cancel(conn->xc_recv_source);
+		}
+		return;
+	}
+
+	ipc_connection_update_watermark(conn);
+}
+
+static void ipc_connection_flush_deferred(void *context)
+{
+	struct ipc_connection *conn = context;
+
+	conn->xc_flush_pending = false;
+	ipc_connection_flush(conn);
+	ipc_connection_release(conn);
+}
+
+static void ipc_connection_create_shards(struct ipc_connection *conn)
+{
+	char *qname;
+	unsigned int i;
+
+	if (conn->xc_shard_count < 2 || conn->xc_shards != NULL)
+	{
+		return;
+	}
+
+	conn->xc_shards = calloc(conn->xc_shard_count, sizeof(dispatch_queue_t));
+	conn->xc_shard_peers = calloc(conn->xc_shard_count, sizeof(unsigned int));
+	if (conn->xc_shards == NULL || conn->xc_shard_peers == NULL)
+	{
+		debugf("cannot allocate %u shards", conn->xc_shard_count);
+		free(conn->xc_shards);
+		free(conn->xc_shard_peers);
+		conn->xc_shards = NULL;
+		conn->xc_shard_peers = NULL;
+		return;
+	}
+
+	for (i = 0; i < conn->xc_shard_count; i++)
+	{
+		asprintf(&qname, "net.ymlab.ipc.connection.shard.%u.%p", i, conn);
+		conn->xc_shards[i] = dispatch_queue_create(qname, NULL);
+		dispatch_queue_set_specific(conn->xc_shards[i], &ipc_reader_key, conn->xc_shards[i], NULL);
+		free(qname);
+	}
+}
+
+/*
+ * Peer queues all target one concurrent queue, so a slow peer only holds
+ * up its own events. At most xc_worker_count peers are draining at once,
+ * the rest wait on the ready list without holding a thread.
+ */
+static void ipc_connection_create_workers(struct ipc_connection *conn)
+{
+	char *qname;
+
+	if (conn->xc_worker_count == 0 || conn->xc_workers != NULL)
+	{
+		return;
+	}
+
+	asprintf(&qname, "net.ymlab.ipc.connection.workers.%p", conn);
+	conn->xc_workers = dispatch_queue_create(qname, DISPATCH_QUEUE_CONCURRENT);
+	free(qname);
+}
+
+/* Runs on the peer's queue while the peer holds one of the listener's slots */
+static void ipc_connection_worker_drain(void *context)
+{
+	struct ipc_connection *peer = context;
+	struct ipc_connection *parent = peer->xc_parent;
+	struct ipc_connection *next;
+	struct ipc_work *work;
+	size_t budget = IPC_SCHED_BATCH;
+	bool idle;
+
+	pthread_mutex_lock(&parent->xc_worker_lock);
+	while (budget > 0 && (work = peer->xc_work_head) != NULL)
+	{
+		if ((peer->xc_work_head = work->xw_next) == NULL)
+		{
+			peer->xc_work_tail = NULL;
+		}
+		pthread_mutex_unlock(&parent->xc_worker_lock);
+
+		work->xw_function(work->xw_context);
+		free(work);
+		budget--;
+
+		pthread_mutex_lock(&parent->xc_worker_lock);
+	}
+
+	/* A peer with work left queues up again behind the peers already waiting for the slot */
+	peer->xc_work_running = false;
+	idle = peer->xc_work_head == NULL;
+	if (!idle)
+	{
+		TAILQ_INSERT_TAIL(&parent->xc_worker_ready, peer, xc_worker_link);
+	}
+
+	if ((next = TAILQ_FIRST(&parent->xc_worker_ready)) != NULL)
+	{
+		TAILQ_REMOVE(&parent->xc_worker_ready, next, xc_worker_link);
+		next->xc_work_running = true;
+	}
+	else
+	{
+		parent->xc_worker_busy--;
+	}
+	pthread_mutex_unlock(&parent->xc_worker_lock);
+
+	if (next != NULL)
+	{
+		dispatch_async_f(next->xc_peer_queue, next, ipc_connection_worker_drain);
+	}
+
+	if (idle)
+	{
+		ipc_connection_release(peer);
+	}
+}
+
+/* A peer with work holds a reference until a drain finds its list empty */
+static void ipc_connection_worker_submit(struct ipc_connection *peer, struct ipc_work *work)
+{
+	struct ipc_connection *parent = peer->xc_parent;
+	bool start = false;
+
+	work->xw_next = NULL;
+
+	pthread_mutex_lock(&parent->xc_worker_lock);
+	if (peer->xc_work_tail != NULL)
+	{
+		peer->xc_work_tail->xw_next = work;
+	}
+	else
+	{
+		peer->xc_work_head = work;
+	}
+	peer->xc_work_tail = work;
+
+	if (peer->xc_work_head == work && !peer->xc_work_running)
+	{
+		ipc_connection_retain(peer);
+		if (parent->xc_worker_busy < parent->xc_worker_count)
+		{
+			parent->xc_worker_busy++;
+			peer->xc_work_running = true;
+			start = true;
+		}
+		else
+		{
+			TAILQ_INSERT_TAIL(&parent->xc_worker_ready, peer, xc_worker_link);
+		}
+	}
+	pthread_mutex_unlock(&parent->xc_worker_lock);
+
+	if (start)
+	{
+		dispatch_async_f(peer->xc_peer_queue, peer, ipc_connection_worker_drain);
+	}
+}
+
+/* Work for a worker peer's queue goes through its slot, anything else straight to the queue */
+static void ipc_connection_async_f(struct ipc_connection *conn, dispatch_queue_t queue, void *context, dispatch_function_t function)
+{
+	struct ipc_work *work;
+
+	if (conn->xc_peer_queue == NULL || queue != conn->xc_peer_queue)
+	{
+		dispatch_async_f(queue, context, function);
+		return;
+	}
+
+	if ((work = malloc(sizeof(*work))) == NULL)
+	{
+		/* Still serial on the peer's queue, only the slot and the order against the list are lost */
+		debugf("cannot allocate work for peer %p", conn);
+		dispatch_async_f(queue, context, function);
+		return;
+	}
+
+	work->xw_function = function;
+	work->xw_context = context;
+	ipc_connection_worker_submit(conn, work);
+}
+
+static void ipc_connection_run_block(void *context)
+{
+	dispatch_block_t block = context;
+
+	block();
+	Block_release(block);
+}
+
+static void ipc_connection_async(struct ipc_connection *conn, dispatch_queue_t queue, dispatch_block_t block)
+{
+	if (conn->xc_peer_queue == NULL || queue != conn->xc_peer_queue)
+	{
+		dispatch_async(queue, block);
+		return;
+	}
+
+	ipc_connection_async_f(conn, queue, Block_copy(block), ipc_connection_run_block);
+}
+
+/* Called with xc_peers_lock held: the shard with the fewest live peers takes the next one */
+static unsigned int ipc_connection_pick_shard(struct ipc_connection *conn)
+{
+	unsigned int i, shard = 0;
+
+	for (i = 1; i < conn->xc_shard_count; i++)
+	{
+		if (conn->xc_shard_peers[i] < conn->xc_shard_peers[shard])
+		{
+			shard = i;
+		}
+	}
+
+	conn->xc_shard_peers[shard]++;
+	return (shard);
+}
+
+static size_t ipc_connection_peer_slot(struct ipc_connection *conn, ipc_port_t port)
+{
+	/* Multiplying by an odd constant keeps consecutive descriptors in distinct slots */
+	return ((size_t)((uint64_t)port * 0x9e3779b97f4a7c15ULL) & (conn->xc_peer_slots - 1));
+}
+
+static void ipc_connection_peer_place(struct ipc_connection *conn, struct ipc_connection *peer)
+{
+	size_t i;
+
+	for (i = ipc_connection_peer_slot(conn, peer->xc_local_port); conn->xc_peer_table[i] != NULL; i = (i + 1) & (conn->xc_peer_slots - 1))
+		;
+
+	conn->xc_peer_table[i] = peer;
+}
+
+static int ipc_connection_peer_grow(struct ipc_connection *conn)
+{
+	struct ipc_connection **old = conn->xc_peer_table;
+	size_t slots = conn->xc_peer_slots, i;
+	struct ipc_connection **table;
+
+	if ((table = calloc(slots ? slots * 2 : IPC_PEER_TABLE_SLOTS, sizeof(*table))) == NULL)
+	{
+		return (-1);
+	}
+
+	conn->xc_peer_table = table;
+	conn->xc_peer_slots = slots ? slots * 2 : IPC_PEER_TABLE_SLOTS;
+
+	for (i = 0; i < slots; i++)
+	{
+		if (old[i] != NULL)
+		{
+			ipc_connection_peer_place(conn, old[i]);
+		}
+	}
+
+	free(old);
+	return (0);
+}
+
+static void ipc_connection_peer_insert(struct ipc_connection *conn, struct ipc_connection *peer)
+{
+	/* Linear probing stays short while the table is at most half full */
+	if ((conn->xc_peer_count + 1) * 2 > conn->xc_peer_slots && ipc_connection_peer_grow(conn) != 0 &&
+		conn->xc_peer_count + 1 >= conn->xc_peer_slots)
+	{
+		debugf("cannot grow peer table, peer=%p is not indexed", peer);
+		return;
+	}
+
+	ipc_connection_peer_place(conn, peer);
+	conn->xc_peer_count++;
+}
+
+static void ipc_connection_peer_remove(struct ipc_connection *conn, struct ipc_connection *peer)
+{
+	size_t mask = conn->xc_peer_slots - 1;
+	size_t i, j, home;
+
+	if (conn->xc_peer_slots == 0)
+	{
+		return;
+	}
+
+	for (i = ipc_connection_peer_slot(conn, peer->xc_local_port); conn->xc_peer_table[i] != peer; i = (i + 1) & mask)
+	{
+		if (conn->xc_peer_table[i] == NULL)
+		{
+			return;
+		}
+	}
+
+	/* Shift later members of the probe run back so lookups never need tombstones */
+	for (j = (i + 1) & mask; conn->xc_peer_table[j] != NULL; j = (j + 1) & mask)
+	{
+		home = ipc_connection_peer_slot(conn, conn->xc_peer_table[j]->xc_local_port);
+		if (((j - home) & mask) >= ((j - i) & mask))
+		{
+			conn->xc_peer_table[i] = conn->xc_peer_table[j];
+			i = j;
+		}
+	}
+
+	conn->xc_peer_table[i] = NULL;
+	conn->xc_peer_count--;
+}
+
+struct ipc_connection *ipc_connection_get_peer(void *context, ipc_port_t port)
+{
+	struct ipc_connection *conn = context;
+	struct ipc_connection *peer = NULL;
+	size_t i;
+
+	pthread_mutex_lock(&conn->xc_peers_lock);
+	if (conn->xc_peer_slots > 0)
+	{
+		for (i = ipc_connection_peer_slot(conn, port); conn->xc_peer_table[i] != NULL; i = (i + 1) & (conn->xc_peer_slots - 1))
+		{
+			if (unix_port_compare(port, conn->xc_peer_table[i]->xc_local_port))
+			{
+				peer = conn->xc_peer_table[i];
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&conn->xc_peers_lock);
+
+	return (peer);
+}
+
+static bool ipc_connection_apply(struct ipc_connection *conn, ipc_connection_applier_t applier, void *context,
+								 ipc_connection_applier_function_t function)
+{
+	struct ipc_connection **peers;
+	size_t count = 0, i, j;
+
+	/* Walk a snapshot so the applier never runs under the lock the accept path takes */
+	pthread_mutex_lock(&conn->xc_peers_lock);
+	if ((peers = malloc((conn->xc_peer_count + 1) * sizeof(*peers))) == NULL)
+	{
+		pthread_mutex_unlock(&conn->xc_peers_lock);
+		errno = ENOMEM;
+		return (false);
+	}
+
+	for (i = 0; i < conn->xc_peer_slots; i++)
+	{
+		if (conn->xc_peer_table[i] != NULL)
+		{
+			/* A peer torn down while the applier runs stays alive until the walk is done */
+			peers[count] = conn->xc_peer_table[i];
+			ipc_connection_retain(peers[count++]);
+		}
+	}
+	pthread_mutex_unlock(&conn->xc_peers_lock);
+
+	for (i = 0; i < count; i++)
+	{
+		if (applier ? !applier((ipc_connection_t)peers[i]) : !function(context, (ipc_connection_t)peers[i]))
+		{
+			break;
+		}
+	}
+
+	for (j = 0; j < count; j++)
+	{
+		ipc_connection_release(peers[j]);
+	}
+
+	free(peers);
+	return (i == count);
+}
+
+bool ipc_connection_apply_peers(ipc_connection_t xconn, ipc_connection_applier_t applier)
+{
+	return (ipc_connection_apply((struct ipc_connection *)xconn, applier, NULL, NULL));
+}
+
+bool ipc_connection_apply_peers_f(ipc_connection_t xconn, void *context, ipc_connection_applier_function_t applier)
+{
+	return (ipc_connection_apply((struct ipc_connection *)xconn, NULL, context, applier));
+}
+
+/* The peer stays in the table until its cancel handler tears it down */
+static void ipc_connection_reap_locked(struct ipc_connection *peer)
+{
+	peer->xc_reaped = true;
+	if (peer->xc_recv_source != NULL)
+	{
+		dispatch_source_cancel(peer->xc_recv_source);
+	}
+}
+
+static void ipc_connection_reap_idle(void *context)
+{
+	struct ipc_connection *conn = context;
+	struct ipc_connection *peer;
+	uint64_t now = ipc_monotonic_time();
+	size_t i;
+
+	pthread_mutex_lock(&conn->xc_peers_lock);
+	for (i = 0; i < conn->xc_peer_slots && conn->xc_idle_timeout > 0; i++)
+	{
+		peer = conn->xc_peer_table[i];
+
+		/* A peer whose messages are still being handled is busy, not idle */
+		if (peer == NULL || peer->xc_reaped || atomic_load(&peer->xc_recv_inflight) > 0 ||
+			now - atomic_load_explicit(&peer->xc_last_active, memory_order_relaxed) < conn->xc_idle_timeout)
+		{
+			continue;
+		}
+
+		debugf("reaping idle peer=%p", peer);
+		ipc_connection_reap_locked(peer);
+		conn->xc_listener_stats.idle_reaped++;
+	}
+	pthread_mutex_unlock(&conn->xc_peers_lock);
+}
+
+/* At the peer limit the least recently active peer makes room for the new one */
+static void ipc_connection_evict_locked(struct ipc_connection *conn)
+{
+	struct ipc_connection *peer, *victim = NULL;
+	size_t i, live = 0;
+
+	for (i = 0; i < conn->xc_peer_slots; i++)
+	{
+		if ((peer = conn->xc_peer_table[i]) == NULL || peer->xc_reaped)
+		{
+			continue;
+		}
+
+		live++;
+		if (victim == NULL || atomic_load_explicit(&peer->xc_last_active, memory_order_relaxed) <
+								  atomic_load_explicit(&victim->xc_last_active, memory_order_relaxed))
+		{
+			victim = peer;
+		}
+	}
+
+	if (victim == NULL || live < conn->xc_max_peers)
+	{
+		return;
+	}
+
+	debugf("peer limit reached, evicting peer=%p", victim);
+	ipc_connection_reap_locked(victim);
+	conn->xc_listener_stats.evicted++;
+}
+
+void *ipc_connection_new_peer(void *context, ipc_port_t local, dispatch_source_t src)
+{
+
+	struct ipc_connection *conn = context;
+	dispatch_queue_t targetq = conn->xc_target_queue;
+	dispatch_queue_t shardq = NULL, peerq = NULL;
+	unsigned int shard = 0;
+	char *qname;
+
+	pthread_mutex_lock(&conn->xc_peers_lock);
+	if (conn->xc_shards != NULL)
+	{
+		shard = ipc_connection_pick_shard(conn);
+		targetq = shardq = conn->xc_shards[shard];
+	}
+	pthread_mutex_unlock(&conn->xc_peers_lock);
+
+	/* Each peer's handlers stay in order on its own queue, peers run side by side on the workers */
+	if (conn->xc_workers != NULL)
+	{
+		asprintf(&qname, "net.ymlab.ipc.connection.peer.%p", (void *)local);
+		targetq = peerq = dispatch_queue_create(qname, NULL);
+		dispatch_set_target_queue(targetq, conn->xc_workers);
+		free(qname);
+	}
+
+	struct ipc_connection *peer = (struct ipc_connection *)ipc_connection_create(targetq);
+	peer->xc_parent = conn;
+	peer->xc_peer_queue = peerq;
+	peer->xc_local_port = local;
+	peer->xc_recv_source = src;
+	peer->xc_shard = shard;
+	peer->xc_recv_limit = conn->xc_recv_limit;
+	peer->xc_recv_byte_limit = conn->xc_recv_byte_limit;
+	peer->xc_reply_timeout = conn->xc_reply_timeout;
+	peer->xc_inline_delivery = conn->xc_inline_delivery;
+	atomic_store_explicit(&peer->xc_last_active, ipc_monotonic_time(), memory_order_relaxed);
+
+	pthread_mutex_lock(&conn->xc_peers_lock);
+	if (conn->xc_max_peers > 0 && conn->xc_peer_count >= conn->xc_max_peers)
+	{
+		ipc_connection_evict_locked(conn);
+	}
+	ipc_connection_peer_insert(conn, peer);
+	pthread_mutex_unlock(&conn->xc_peers_lock);
+
+	if (src)
+	{
+		dispatch_set_context(src, peer);
+		/* A sharded peer reads and delivers on its shard for its whole life */
+		if (shardq != NULL)
+		{
+			dispatch_set_target_queue(src, shardq);
+		}
+		dispatch_resume(src);
+		ipc_connection_retain(peer);
+		dispatch_async(conn->xc_target_queue, ^{
+		  ipc_connection_notify(conn, peer);
+		  ipc_connection_release(peer);
+		});
+	}
+
+	return (peer);
+}
+
+void ipc_connection_record_accepts(void *context, size_t pending, size_t accepted, int error)
+{
+	struct ipc_connection *conn = context;
+	struct ipc_listener_statistics *stats = &conn->xc_listener_stats;
+
+	pthread_mutex_lock(&conn->xc_peers_lock);
+	stats->accept_wakeups++;
+	stats->accepted += accepted;
+	if (accepted > stats->max_accepts_per_wakeup)
+	{
+		stats->max_accepts_per_wakeup = accepted;
+	}
+
+	/* A queue that was full when the source fired may have refused connections */
+	if (pending >= (size_t)conn->xc_listen_backlog)
+	{
+		stats->queue_overflows++;
+	}
+
+	if (error != 0)
+	{
+		stats->accept_errors++;
+	}
+	pthread_mutex_unlock(&conn->xc_peers_lock);
+}
+
+static void ipc_connection_free(struct ipc_connection *conn)
+{
+	struct ipc_connection_op *op;
+	struct ipc_pending_call *call;
+
+	debugf("connection=%p", conn);
+
+	while ((op = conn->xc_op_pool) != NULL)
+	{
+		conn->xc_op_pool = op->xq_next;
+		free(op);
+	}
+
+	while ((call = conn->xc_pending_pool) != NULL)
+	{
+		conn->xc_pending_pool = call->xp_next;
+		free(call);
+	}
+
+	if (conn->xc_wheel_source != NULL)
+	{
+		dispatch_release(conn->xc_wheel_source);
+	}
+
+	/* A peer nobody resumed still has its receive queue suspended */
+	if (!conn->xc_resumed)
+	{
+		dispatch_resume(conn->xc_recv_queue);
+	}
+	dispatch_release(conn->xc_recv_queue);
+	dispatch_release(conn->xc_send_queue);
+	if (conn->xc_peer_queue != NULL)
+	{
+		dispatch_release(conn->xc_peer_queue);
+	}
+
+	if (conn->xc_handler != NULL)
+	{
+		Block_release(conn->xc_handler);
+	}
+	if (conn->xc_watermark_handler != NULL)
+	{
+		Block_release(conn->xc_watermark_handler);
+	}
+	if (conn->xc_batch_handler != NULL)
+	{
+		Block_release(conn->xc_batch_handler);
+	}
+
+	pthread_mutex_destroy(&conn->xc_peers_lock);
+	pthread_mutex_destroy(&conn->xc_pending_lock);
+	pthread_mutex_destroy(&conn->xc_ops_lock);
+	pthread_mutex_destroy(&conn->xc_sched_lock);
+	pthread_mutex_destroy(&conn->xc_worker_lock);
+	free(conn->xc_recv_batch);
+	free(conn->xc_wheel);
+	free(conn->xc_pending);
+	free(conn);
+}
+
+/* Queued work that refers to the connection holds a reference until it has run */
+static void ipc_connection_retain(struct ipc_connection *conn)
+{
+	atomic_fetch_add_explicit(&conn->xc_refcount, 1, memory_order_relaxed);
+}
+
+static void ipc_connection_release(struct ipc_connection *conn)
+{
+	if (atomic_fetch_sub_explicit(&conn->xc_refcount, 1, memory_order_acq_rel) == 1)
+	{
+		ipc_connection_free(conn);
+	}
+}
+
+void ipc_connection_destroy_peer(void *context)
+{
+	struct ipc_connection *conn, *parent;
+
+	conn = context;
+	parent = conn->xc_parent;
+
+	if (conn->xc_parent != NULL)
+	{
+		pthread_mutex_lock(&parent->xc_peers_lock);
+		ipc_connection_peer_remove(parent, conn);
+		if (parent->xc_shards != NULL)
+		{
+			parent->xc_shard_peers[conn->xc_shard]--;
+		}
+		pthread_mutex_unlock(&parent->xc_peers_lock);
+	}
+
+	ipc_buffer_destroy(&conn->xc_recv_buffer);
+	ipc_buffer_destroy(&conn->xc_recv_partial);
+	ipc_pipe_close_fds(&conn->xc_recv_fds);
+	conn->xc_shm_rx = NULL;
+
+	/* Synchronous: the write source has to be gone before the transport closes the socket */
+	dispatch_sync(conn->xc_send_queue, ^{
+	  conn->xc_send_closed = true;
+	  if (conn->xc_send_source != NULL)
+	  {
+		  if (!conn->xc_send_armed)
+			  dispatch_resume(conn->xc_send_source);
+		  dispatch_source_cancel(conn->xc_send_source);
+		  dispatch_release(conn->xc_send_source);
+		  conn->xc_send_source = NULL;
+		  conn->xc_send_armed = false;
+	  }
+	  ipc_buffer_destroy(&conn->xc_send_buffer);
+	  ipc_buffer_destroy(&conn->xc_send_fds);
+	  ipc_buffer_destroy(&conn->xc_bulk_buffer);
+	  ipc_buffer_destroy(&conn->xc_bulk_fds);
+	  ipc_buffer_destroy(&conn->xc_send_ids);
+	  ipc_buffer_destroy(&conn->xc_bulk_ids);
+	  shm_release(conn->xc_shm_tx);
+	  conn->xc_shm_tx = NULL;
+	});
+
+	/* Nothing answers the calls still waiting, calls made from now on fail on send */
+	ipc_connection_pending_fail_all(conn);
+	ipc_connection_sched_flush(conn);
+
+	pthread_mutex_lock(&conn->xc_pending_lock);
+	if (conn->xc_wheel_source != NULL)
+	{
+		dispatch_source_cancel(conn->xc_wheel_source);
+	}
+	pthread_mutex_unlock(&conn->xc_pending_lock);
+
+	/* Queued behind every event and failed call, so the finalizer really is the last word */
+	ipc_connection_async(conn, conn->xc_target_queue, ^{
+	  ipc_object_t error = ipc_error_create(IPC_ERROR_CONNECTION_INVALID);
+	  ipc_connection_notify(conn, error);
+	  ipc_release(error);
+	  if (conn->xc_finalizer != NULL)
+	  {
+		  conn->xc_finalizer(conn->xc_context);
+	  }
+
+	  /* The caller owns a client connection, a peer goes once the last queued delivery is done */
+	  if (conn->xc_parent != NULL)
+	  {
+		  ipc_connection_release(conn);
+	  }
+	});
+
+	dispatch_release(conn->xc_recv_source);
+}
+
+static bool ipc_connection_recv_over(struct ipc_connection *conn, size_t divisor)
+{
+	size_t inflight = atomic_load(&conn->xc_recv_inflight);
+	size_t bytes = atomic_load(&conn->xc_recv_inflight_bytes);
+
+	return ((conn->xc_recv_limit > 0 && inflight >= MAX(conn->xc_recv_limit / divisor, 1)) ||
+			(conn->xc_recv_byte_limit > 0 && bytes >= MAX(conn->xc_recv_byte_limit / divisor, 1)));
+}
+
+static void ipc_connection_resume_recv(struct ipc_connection *conn)
+{
+	bool paused = true;
+
+	/* Reading resumes once the backlog has drained to half of the limits */
+	if (ipc_connection_recv_over(conn, 2))
+	{
+		return;
+	}
+
+	if (atomic_compare_exchange_strong(&conn->xc_recv_paused, &paused, false))
+	{
+		debugf("connection=%p resuming reads", conn);
+		dispatch_resume(conn->xc_recv_source);
+	}
+}
+
+static bool ipc_connection_pause_recv(struct ipc_connection *conn)
+{
+	if (atomic_load(&conn->xc_recv_paused))
+	{
+		return (true);
+	}
+
+	if (!ipc_connection_recv_over(conn, 1))
+	{
+		return (false);
+	}
+
+	/*
+	 * Only the read handler pauses, so the flag is raised after the source
+	 * is suspended: whoever clears it may resume right away. Deliveries
+	 * that completed before the flag went up are caught by the recheck.
+	 */
+	debugf("connection=%p pausing reads", conn);
+	dispatch_suspend(conn->xc_recv_source);
+	atomic_store(&conn->xc_recv_paused, true);
+	ipc_connection_resume_recv(conn);
+
+	return (true);
+}
+
+static void ipc_connection_delivered(struct ipc_connection *conn, size_t count, size_t size)
+{
+	atomic_fetch_sub(&conn->xc_recv_inflight, count);
+	atomic_fetch_sub(&conn->xc_recv_inflight_bytes, size);
+
+	if (atomic_load(&conn->xc_recv_paused))
+	{
+		ipc_connection_resume_recv(conn);
+	}
+}
+
+static struct ipc_pending_call *ipc_connection_pending_alloc(struct ipc_connection *conn)
+{
+	struct ipc_pending_call *call;
+
+	pthread_mutex_lock(&conn->xc_pending_lock);
+	if ((call = conn->xc_pending_pool) != NULL)
+	{
+		conn->xc_pending_pool = call->xp_next;
+		conn->xc_pending_pooled--;
+	}
+	pthread_mutex_unlock(&conn->xc_pending_lock);
+
+	if (call == NULL && (call = malloc(sizeof(struct ipc_pending_call))) == NULL)
+	{
+		errno = ENOMEM;
+		return (NULL);
+	}
+
+	memset(call, 0, sizeof(struct ipc_pending_call));
+	return (call);
+}
+
+static void ipc_connection_pending_free(struct ipc_connection *conn, struct ipc_pending_call *call)
+{
+	if (call->xp_handler != NULL)
+	{
+		Block_release(call->xp_handler);
+	}
+
+	pthread_mutex_lock(&conn->xc_pending_lock);
+	if (conn->xc_pending_pooled < IPC_PENDING_POOL_MAX)
+	{
+		call->xp_next = conn->xc_pending_pool;
+		conn->xc_pending_pool = call;
+		conn->xc_pending_pooled++;
+		call = NULL;
+	}
+	pthread_mutex_unlock(&conn->xc_pending_lock);
+
+	free(call);
+}
+
+static void ipc_connection_pending_grow(struct ipc_connection *conn)
+{
+	struct ipc_pending_call **table, *call, *next;
+	size_t buckets, i;
+
+	buckets = conn->xc_pending_buckets * 2;
+	if ((table = calloc(buckets, sizeof(*table))) == NULL)
+	{
+		/* Longer chains are still correct */
+		return;
+	}
+
+	for (i = 0; i < conn->xc_pending_buckets; i++)
+	{
+		for (call = conn->xc_pending[i]; call != NULL; call = next)
+		{
+			next = call->xp_next;
+			call->xp_next = table[call->xp_id & (buckets - 1)];
+			table[call->xp_id & (buckets - 1)] = call;
+		}
+	}
+
+	free(conn->xc_pending);
+	conn->xc_pending = table;
+	conn->xc_pending_buckets = buckets;
+}
+
+static uint64_t ipc_connection_current_tick(void)
+{
+	return (ipc_monotonic_time() / IPC_TIMER_TICK);
+}
+
+static struct ipc_pending_call *ipc_connection_pending_unlink_locked(struct ipc_connection *conn, uint64_t id)
+{
+	struct ipc_pending_call **link, *call;
+
+	for (link = &conn->xc_pending[id & (conn->xc_pending_buckets - 1)]; (call = *link) != NULL; link = &call->xp_next)
+	{
+		if (call->xp_id == id)
+		{
+			*link = call->xp_next;
+			conn->xc_pending_count--;
+			return (call);
+		}
+	}
+
+	return (NULL);
+}
+
+static void ipc_connection_timer_remove_locked(struct ipc_connection *conn, struct ipc_pending_call *call)
+{
+	if (call->xp_deadline == 0)
+	{
+		return;
+	}
+
+	TAILQ_REMOVE(&conn->xc_wheel[call->xp_deadline & (IPC_TIMER_WHEEL_SLOTS - 1)], call, xp_timer_link);
+	call->xp_deadline = 0;
+	conn->xc_wheel_count--;
+}
+
+static void ipc_connection_pending_fail_all(struct ipc_connection *conn)
+{
+	struct ipc_pending_call *call, *next, *failed = NULL;
+	ipc_object_t error;
+	size_t i;
+
+	pthread_mutex_lock(&conn->xc_pending_lock);
+	for (i = 0; i < conn->xc_pending_buckets; i++)
+	{
+		for (call = conn->xc_pending[i]; call != NULL; call = next)
+		{
+			next = call->xp_next;
+			ipc_connection_timer_remove_locked(conn, call);
+			call->xp_next = failed;
+			failed = call;
+		}
+		conn->xc_pending[i] = NULL;
+	}
+	conn->xc_pending_count = 0;
+	pthread_mutex_unlock(&conn->xc_pending_lock);
+
+	error = ipc_error_create(IPC_ERROR_CONNECTION_INVALID);
+	for (call = failed; call != NULL; call = next)
+	{
+		next = call->xp_next;
+		ipc_connection_dispatch_callback(conn, error, call, NULL);
+	}
+	ipc_release(error);
+}
+
+static void ipc_connection_pending_wake(struct ipc_connection *conn, struct ipc_pending_call *call, ipc_object_t result)
+{
+	struct ipc_sync_waiter *waiter = call->xp_waiter;
+	dispatch_semaphore_t sem = waiter->sw_sem;
+
+	waiter->sw_result = ipc_retain(result);
+	ipc_connection_pending_free(conn, call);
+
+	/* Once the state flips the waiter may return, only a sleeping one still needs the semaphore */
+	if (atomic_exchange(&waiter->sw_state, IPC_SYNC_DONE) == IPC_SYNC_SLEEPING)
+	{
+		dispatch_semaphore_signal(sem);
+	}
+}
+
+static void ipc_connection_timer_fire(void *context)
+{
+	struct ipc_connection *conn = context;
+	struct ipc_pending_timers *slot;
+	struct ipc_pending_call *call, *next, *expired = NULL;
+	ipc_object_t error;
+	uint64_t now, tick;
+	size_t scanned;
+
+	pthread_mutex_lock(&conn->xc_pending_lock);
+	now = ipc_connection_current_tick();
+
+	/* Calls due in a later revolution share the slot and stay behind */
+	for (tick = conn->xc_wheel_tick + 1, scanned = 0; tick <= now && scanned < IPC_TIMER_WHEEL_SLOTS; tick++, scanned++)
+	{
+		slot = &conn->xc_wheel[tick & (IPC_TIMER_WHEEL_SLOTS - 1)];
+		for (call = TAILQ_FIRST(slot); call != NULL; call = next)
+		{
+			next = TAILQ_NEXT(call, xp_timer_link);
+			if (call->xp_deadline <= now)
+			{
+				ipc_connection_timer_remove_locked(conn, call);
+				ipc_connection_pending_unlink_locked(conn, call->xp_id);
+				call->xp_next = expired;
+				expired = call;
+			}
+		}
+	}
+
+	conn->xc_wheel_tick = now;
+	if (conn->xc_wheel_count == 0 && conn->xc_wheel_armed)
+	{
+		dispatch_source_set_timer(conn->xc_wheel_source, DISPATCH_TIME_FOREVER, 0, 0);
+		conn->xc_wheel_armed = false;
+	}
+	pthread_mutex_unlock(&conn->xc_pending_lock);
+
+	for (call = expired; call != NULL; call = next)
+	{
+		next = call->xp_next;
+		debugf("call id=%llu timed out", call->xp_id);
+		error = ipc_error_create(IPC_ERROR_TIMEOUT);
+		ipc_connection_dispatch_callback(conn, error, call, NULL);
+		ipc_release(error);
+	}
+}
+
+static void ipc_connection_timer_cancelled(void *context)
+{
+	ipc_connection_release(context);
+}
+
+static void ipc_connection_timer_insert_locked(struct ipc_connection *conn, struct ipc_pending_call *call, uint64_t timeout)
+{
+	size_t i;
+
+	if (conn->xc_wheel == NULL)
+	{
+		if ((conn->xc_wheel = malloc(IPC_TIMER_WHEEL_SLOTS * sizeof(struct ipc_pending_timers))) == NULL)
+		{
+			debugf("cannot allocate timer wheel, call id=%llu waits forever", call->xp_id);
+			return;
+		}
+
+		for (i = 0; i < IPC_TIMER_WHEEL_SLOTS; i++)
+		{
+			TAILQ_INIT(&conn->xc_wheel[i]);
+		}
+	}
+
+	if (conn->xc_wheel_source == NULL)
+	{
+		conn->xc_wheel_source = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0,
+													   dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0));
+		dispatch_set_context(conn->xc_wheel_source, conn);
+		dispatch_source_set_event_handler_f(conn->xc_wheel_source, ipc_connection_timer_fire);
+		ipc_connection_retain(conn);
+		dispatch_source_set_cancel_handler_f(conn->xc_wheel_source, ipc_connection_timer_cancelled);
+		dispatch_source_set_timer(conn->xc_wheel_source, DISPATCH_TIME_FOREVER, 0, 0);
+		dispatch_resume(conn->xc_wheel_source);
+	}
+
+	/* One tick per connection while calls are waiting, none otherwise */
+	if (!conn->xc_wheel_armed)
+	{
+		conn->xc_wheel_tick = ipc_connection_current_tick();
+		dispatch_source_set_timer(conn->xc_wheel_source, dispatch_time(DISPATCH_TIME_NOW, IPC_TIMER_TICK),
+								  IPC_TIMER_TICK, IPC_TIMER_TICK / 10);
+		conn->xc_wheel_armed = true;
+	}
+
+	/* Rounded up, so a call never expires early */
+	call->xp_deadline = ipc_connection_current_tick() + 1 + howmany(timeout, IPC_TIMER_TICK);
+	TAILQ_INSERT_TAIL(&conn->xc_wheel[call->xp_deadline & (IPC_TIMER_WHEEL_SLOTS - 1)], call, xp_timer_link);
+	conn->xc_wheel_count++;
+}
+
+static void ipc_connection_pending_insert(struct ipc_connection *conn, struct ipc_pending_call *call, uint64_t timeout)
+{
+	struct ipc_pending_call **bucket;
+
+	pthread_mutex_lock(&conn->xc_pending_lock);
+	if (conn->xc_pending_count >= conn->xc_pending_buckets)
+	{
+		ipc_connection_pending_grow(conn);
+	}
+
+	/* Ids are sequential, so the low bits spread calls evenly over the buckets */
+	bucket = &conn->xc_pending[call->xp_id & (conn->xc_pending_buckets - 1)];
+	call->xp_next = *bucket;
+	*bucket = call;
+	conn->xc_pending_count++;
+
+	if (timeout > 0)
+	{
+		ipc_connection_timer_insert_locked(conn, call, timeout);
+	}
+	pthread_mutex_unlock(&conn->xc_pending_lock);
+}
+
+static struct ipc_pending_call *ipc_connection_pending_remove(struct ipc_connection *conn, uint64_t id)
+{
+	struct ipc_pending_call *call;
+
+	pthread_mutex_lock(&conn->xc_pending_lock);
+	if ((call = ipc_connection_pending_unlink_locked(conn, id)) != NULL)
+	{
+		ipc_connection_timer_remove_locked(conn, call);
+	}
+	pthread_mutex_unlock(&conn->xc_pending_lock);
+
+	return (call);
+}
+
+static __thread int ipc_handler_context = IPC_HANDLER_CONTEXT_NONE;
+
+int ipc_connection_get_handler_context(void)
+{
+	return (ipc_handler_context);
+}
+
+static dispatch_queue_t ipc_connection_reader_queue(struct ipc_connection *conn)
+{
+	struct ipc_connection *parent = conn->xc_parent;
+
+	if (parent == NULL)
+	{
+		return (conn->xc_recv_queue);
+	}
+
+	return (parent->xc_shards != NULL ? parent->xc_shards[conn->xc_shard] : parent->xc_recv_queue);
+}
+
+/*
+ * Runs the block where the connection reads: the client's receive queue,
+ * or for a peer the listener's queue or its shard. A client not resumed
+ * yet is not read at all, and code already on the reader, an inline
+ * handler or a sharded peer's handler, must not wait for itself.
+ */
+static void ipc_connection_on_reader(struct ipc_connection *conn, dispatch_block_t block)
+{
+	dispatch_queue_t readq = ipc_connection_reader_queue(conn);
+
+	if ((conn->xc_parent == NULL && !conn->xc_resumed) || dispatch_get_specific(&ipc_reader_key) == readq)
+	{
+		block();
+		return;
+	}
+
+	dispatch_sync(readq, block);
+}
+
+/*
+ * True when this thread runs on the queue that reads conn: an inline
+ * handler, or a sharded peer's handler on its shard, shared with every
+ * peer of that shard.
+ */
+static bool ipc_connection_reader_busy(struct ipc_connection *conn)
+{
+	return (dispatch_get_specific(&ipc_reader_key) == ipc_connection_reader_queue(conn));
+}
+
+static void ipc_connection_invoke(ipc_handler_t handler, ipc_handler_function_t function, void *ctx, ipc_object_t result, int context)
+{
+	int saved = ipc_handler_context;
+
+	/* Saved and restored, inline delivery can nest inside another handler */
+	ipc_handler_context = context;
+	if (handler != NULL)
+	{
+		handler(result);
+	}
+	else if (function != NULL)
+	{
+		function(ctx, result);
+	}
+	ipc_handler_context = saved;
+}
+
+static void ipc_connection_notify(struct ipc_connection *conn, ipc_object_t object)
+{
+	ipc_connection_invoke(conn->xc_handler, conn->xc_handler_f, conn->xc_context, object, IPC_HANDLER_CONTEXT_QUEUE);
+}
+
+static void ipc_connection_release_batch(ipc_object_t *batch, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+	{
+		ipc_release(batch[i]);
+	}
+
+	free(batch);
+}
+
+static struct ipc_connection_op *ipc_connection_op_alloc(struct ipc_connection *conn)
+{
+	struct ipc_connection_op *op;
+
+	pthread_mutex_lock(&conn->xc_ops_lock);
+	if ((op = conn->xc_op_pool) != NULL)
+	{
+		conn->xc_op_pool = op->xq_next;
+		conn->xc_op_pooled--;
+	}
+	pthread_mutex_unlock(&conn->xc_ops_lock);
+
+	if (op == NULL && (op = malloc(sizeof(struct ipc_connection_op))) == NULL)
+	{
+		errno = ENOMEM;
+		return (NULL);
+	}
+
+	memset(op, 0, sizeof(struct ipc_connection_op));
+	op->xq_conn = conn;
+	ipc_connection_retain(conn);
+	return (op);
+}
+
+static void ipc_connection_op_free(struct ipc_connection_op *op)
+{
+	struct ipc_connection *conn = op->xq_conn;
+
+	pthread_mutex_lock(&conn->xc_ops_lock);
+	if (conn->xc_op_pooled < IPC_OP_POOL_MAX)
+	{
+		op->xq_next = conn->xc_op_pool;
+		conn->xc_op_pool = op;
+		conn->xc_op_pooled++;
+		op = NULL;
+	}
+	pthread_mutex_unlock(&conn->xc_ops_lock);
+
+	free(op);
+	ipc_connection_release(conn);
+}
+
+static void ipc_connection_send_op(void *context)
+{
+	struct ipc_connection_op *op = context;
+
+	if (op->xq_object == NULL)
+	{
+		ipc_send_control(op->xq_conn, op->xq_id, op->xq_flags);
+	}
+	else
+	{
+		ipc_send((ipc_connection_t)op->xq_conn, op->xq_object, op->xq_id, op->xq_flags, op->xq_deadline);
+		ipc_release(op->xq_object);
+	}
+	ipc_connection_op_free(op);
+}
+
+static void ipc_connection_enqueue_send(struct ipc_connection *conn, ipc_object_t message, uint64_t id, uint64_t flags, uint64_t deadline)
+{
+	struct ipc_connection_op *op;
+
+	/* A pooled op and dispatch_async_f: no block is copied per message */
+	if ((op = ipc_connection_op_alloc(conn)) == NULL)
+	{
+		debugf("cannot allocate send op, id=%llu", id);
+		if (message != NULL)
+		{
+			ipc_connection_send_failed(conn, id, flags);
+		}
+		return;
+	}
+
+	op->xq_object = message ? ipc_retain(message) : NULL;
+	op->xq_id = id;
+	op->xq_flags = flags;
+	op->xq_deadline = deadline;
+	dispatch_async_f(conn->xc_send_queue, op, ipc_connection_send_op);
+}
+
+/* The caller gave up on the event while it waited, by its deadline or by cancelling */
+static bool ipc_connection_event_stale(struct ipc_connection *conn, uint64_t id, uint64_t deadline)
+{
+	if (deadline != 0 && ipc_monotonic_time() >= deadline)
+	{
+		debugf("dropping expired call, id=%llu", id);
+		return (true);
+	}
+
+	if (id != 0 && atomic_load_explicit(&conn->xc_cancelled[id & (IPC_CANCEL_SLOTS - 1)], memory_order_relaxed) == id)
+	{
+		debugf("dropping cancelled call, id=%llu", id);
+		return (true);
+	}
+
+	return (false);
+}
+
+static void ipc_connection_deliver_op(void *context)
+{
+	struct ipc_connection_op *op = context;
+	struct ipc_connection *conn = op->xq_conn;
+	struct ipc_pending_call *call = op->xq_call;
+
+	if (call != NULL)
+	{
+		ipc_connection_invoke(call->xp_handler, call->xp_function, call->xp_context, op->xq_object, IPC_HANDLER_CONTEXT_QUEUE);
+		ipc_connection_pending_free(conn, call);
+	}
+	else if (!ipc_connection_event_stale(conn, op->xq_id, op->xq_deadline))
+	{
+		debugf("calling handler=%p", conn->xc_handler);
+		ipc_connection_notify(conn, op->xq_object);
+	}
+
+	ipc_release(op->xq_object);
+	ipc_connection_delivered(conn, 1, op->xq_size);
+	ipc_connection_op_free(op);
+}
+
+static struct ipc_connection_op *ipc_connection_lane_head(struct ipc_connection *conn)
+{
+	int lane;
+
+	/* High priority events overtake everything the connection has queued */
+	for (lane = 0; lane < IPC_LANES; lane++)
+	{
+		if (conn->xc_lane_head[lane] != NULL)
+		{
+			return (conn->xc_lane_head[lane]);
+		}
+	}
+
+	return (NULL);
+}
+
+static void ipc_connection_sched_run(void *context)
+{
+	struct ipc_connection *conn = context;
+	struct ipc_connection *peer;
+	struct ipc_connection_op *op;
+	size_t cost, budget = IPC_SCHED_BATCH;
+
+	pthread_mutex_lock(&conn->xc_sched_lock);
+	while (budget > 0 && (peer = TAILQ_FIRST(&conn->xc_sched_active)) != NULL)
+	{
+		/* Deficit round robin: every visit earns a quantum scaled by the peer's weight */
+		if (!peer->xc_sched_visited)
+		{
+			peer->xc_sched_deficit += (size_t)IPC_SCHED_QUANTUM * peer->xc_weight;
+			peer->xc_sched_visited = true;
+		}
+
+		op = ipc_connection_lane_head(peer);
+		cost = op->xq_size + IPC_SCHED_MESSAGE_COST;
+		if (cost > peer->xc_sched_deficit)
+		{
+			TAILQ_REMOVE(&conn->xc_sched_active, peer, xc_sched_link);
+			TAILQ_INSERT_TAIL(&conn->xc_sched_active, peer, xc_sched_link);
+			peer->xc_sched_visited = false;
+			continue;
+		}
+
+		peer->xc_sched_deficit -= cost;
+		if ((peer->xc_lane_head[op->xq_lane] = op->xq_next) == NULL)
+		{
+			peer->xc_lane_tail[op->xq_lane] = NULL;
+		}
+
+		if (ipc_connection_lane_head(peer) == NULL)
+		{
+			/* An idle peer does not bank credit for later bursts */
+			peer->xc_sched_deficit = 0;
+			peer->xc_sched_visited = false;
+			peer->xc_sched_queued = false;
+			TAILQ_REMOVE(&conn->xc_sched_active, peer, xc_sched_link);
+		}
+		pthread_mutex_unlock(&conn->xc_sched_lock);
+
+		ipc_connection_deliver_op(op);
+		budget--;
+
+		pthread_mutex_lock(&conn->xc_sched_lock);
+	}
+
+	/* Yield the target queue between rounds so unrelated work is not starved */
+	if (TAILQ_EMPTY(&conn->xc_sched_active))
+	{
+		conn->xc_sched_running = false;
+		pthread_mutex_unlock(&conn->xc_sched_lock);
+		ipc_connection_release(conn);
+		return;
+	}
+
+	ipc_connection_async_f(conn, conn->xc_target_queue, conn, ipc_connection_sched_run);
+	pthread_mutex_unlock(&conn->xc_sched_lock);
+}
+
+/*
+ * A closing connection leaves the round robin: whatever its lanes still
+ * hold goes to its target queue in priority order, ahead of the final
+ * error queued after it.
+ */
+static void ipc_connection_sched_flush(struct ipc_connection *conn)
+{
+	struct ipc_connection *owner = conn;
+	struct ipc_connection_op *lanes[IPC_LANES], *op, *next;
+	int lane;
+
+	if (conn->xc_parent != NULL && conn->xc_parent->xc_fair && conn->xc_parent->xc_workers == NULL &&
+		conn->xc_parent->xc_shards == NULL)
+	{
+		owner = conn->xc_parent;
+	}
+
+	pthread_mutex_lock(&owner->xc_sched_lock);
+	if (conn->xc_sched_queued)
+	{
+		TAILQ_REMOVE(&owner->xc_sched_active, conn, xc_sched_link);
+		conn->xc_sched_queued = false;
+	}
+
+	for (lane = 0; lane < IPC_LANES; lane++)
+	{
+		lanes[lane] = conn->xc_lane_head[lane];
+		conn->xc_lane_head[lane] = conn->xc_lane_tail[lane] = NULL;
+	}
+	pthread_mutex_unlock(&owner->xc_sched_lock);
+
+	for (lane = 0; lane < IPC_LANES; lane++)
+	{
+		for (op = lanes[lane]; op != NULL; op = next)
+		{
+			next = op->xq_next;
+			ipc_connection_async_f(conn, conn->xc_target_queue, op, ipc_connection_deliver_op);
+		}
+	}
+}
+
+/*
+ * The owner is the listener under fair queueing and the connection itself
+ * otherwise, in which case the round robin degenerates to draining the
+ * connection's lanes in priority order.
+ */
+static void ipc_connection_sched_enqueue(struct ipc_connection *conn, struct ipc_connection *peer, struct ipc_connection_op *op, int lane)
+{
+	op->xq_next = NULL;
+	op->xq_lane = lane;
+
+	pthread_mutex_lock(&conn->xc_sched_lock);
+	if (peer->xc_lane_tail[lane] != NULL)
+	{
+		peer->xc_lane_tail[lane]->xq_next = op;
+	}
+	else
+	{
+		peer->xc_lane_head[lane] = op;
+	}
+	peer->xc_lane_tail[lane] = op;
+
+	if (!peer->xc_sched_queued)
+	{
+		TAILQ_INSERT_TAIL(&conn->xc_sched_active, peer, xc_sched_link);
+		peer->xc_sched_queued = true;
+	}
+
+	if (!conn->xc_sched_running)
+	{
+		conn->xc_sched_running = true;
+		ipc_connection_retain(conn);
+		ipc_connection_async_f(conn, conn->xc_target_queue, conn, ipc_connection_sched_run);
+	}
+	pthread_mutex_unlock(&conn->xc_sched_lock);
+}
+
+static void ipc_connection_dispatch_inline(struct ipc_connection *conn, ipc_object_t result, struct ipc_pending_call *call,
+											const struct ipc_frame_header *header)
+{
+	/* The reader waits for the handler, which is all the backpressure inline mode needs */
+	if (call != NULL && call->xp_waiter != NULL)
+	{
+		ipc_connection_pending_wake(conn, call, result);
+	}
+	else if (call != NULL)
+	{
+		ipc_connection_invoke(call->xp_handler, call->xp_function, call->xp_context, result, IPC_HANDLER_CONTEXT_INLINE);
+		ipc_connection_pending_free(conn, call);
+	}
+	else if (header == NULL || !ipc_connection_event_stale(conn, header->id, header->spare[0]))
+	{
+		ipc_connection_invoke(conn->xc_handler, conn->xc_handler_f, conn->xc_context, result, IPC_HANDLER_CONTEXT_INLINE);
+	}
+}
+
+static void ipc_connection_dispatch_callback(struct ipc_connection *conn, ipc_object_t result, struct ipc_pending_call *call, const struct ipc_frame_header *header)
+{
+	struct ipc_connection_op *op;
+	struct ipc_connection *owner = NULL;
+	size_t size = header ? (size_t)header->length : 0;
+	bool high = header && (header->flags & IPC_FRAME_HIGH);
+
+	if (call != NULL && call->xp_waiter != NULL)
+	{
+		ipc_connection_pending_wake(conn, call, result);
+		return;
+	}
+
+	if (call == NULL && conn->xc_handler == NULL && conn->xc_handler_f == NULL)
+	{
+		return;
+	}
+
+	if ((op = ipc_connection_op_alloc(conn)) == NULL)
+	{
+		debugf("cannot allocate delivery op, delivering inline");
+		ipc_connection_dispatch_inline(conn, result, call, header);
+		return;
+	}
+
+	op->xq_object = ipc_retain(result);
+	op->xq_call = call;
+	op->xq_size = size;
+	op->xq_id = header ? header->id : 0;
+	op->xq_deadline = (call == NULL && header) ? header->spare[0] : 0;
+	atomic_fetch_add(&conn->xc_recv_inflight, 1);
+	atomic_fetch_add(&conn->xc_recv_inflight_bytes, size);
+
+	/*
+	 * Events of peers under fair queueing run on the listener's queue, in
+	 * deficit round robin order. A connection that has seen a high priority
+	 * event keeps its events in priority lanes from then on.
+	 */
+	if (call == NULL)
+	{
+		if (high)
+		{
+			conn->xc_lanes = true;
+		}
+
+		if (conn->xc_parent != NULL && conn->xc_parent->xc_fair && conn->xc_parent->xc_workers == NULL &&
+			conn->xc_parent->xc_shards == NULL)
+		{
+			owner = conn->xc_parent;
+		}
+		else if (conn->xc_lanes)
+		{
+			owner = conn;
+		}
+	}
+
+	if (owner != NULL)
+	{
+		ipc_connection_sched_enqueue(owner, conn, op, high ? IPC_LANE_HIGH : IPC_LANE_DEFAULT);
+		return;
+	}
+
+	ipc_connection_async_f(conn, call != NULL ? call->xp_queue : conn->xc_target_queue, op, ipc_connection_deliver_op);
+}
+
+static void ipc_connection_invoke_batch(ipc_batch_handler_t handler, ipc_batch_handler_function_t function, void *ctx,
+										ipc_object_t *batch, size_t count)
+{
+	if (handler != NULL)
+	{
+		handler(batch, count);
+	}
+	else if (function != NULL)
+	{
+		function(ctx, batch, count);
+	}
+}
+
+static void ipc_connection_flush_batch(struct ipc_connection *conn)
+{
+	ipc_batch_handler_t handler = conn->xc_batch_handler;
+	ipc_batch_handler_function_t function = conn->xc_batch_handler_f;
+	void *ctx = conn->xc_context;
+	ipc_object_t *batch = conn->xc_recv_batch;
+	size_t count = conn->xc_recv_batch_len;
+	size_t bytes = conn->xc_recv_batch_bytes;
+
+	if (count == 0)
+	{
+		return;
+	}
+
+	/* The array travels with the block, the next pass starts a fresh one */
+	conn->xc_recv_batch = NULL;
+	conn->xc_recv_batch_len = 0;
+	conn->xc_recv_batch_bytes = 0;
+
+	if (conn->xc_inline_delivery)
+	{
+		int saved = ipc_handler_context;
+
+		ipc_handler_context = IPC_HANDLER_CONTEXT_INLINE;
+		ipc_connection_invoke_batch(handler, function, ctx, batch, count);
+		ipc_handler_context = saved;
+		ipc_connection_release_batch(batch, count);
+		return;
+	}
+
+	atomic_fetch_add(&conn->xc_recv_inflight, count);
+	atomic_fetch_add(&conn->xc_recv_inflight_bytes, bytes);
+	ipc_connection_retain(conn);
+	ipc_connection_async(conn, conn->xc_target_queue, ^{
+	  ipc_handler_context = IPC_HANDLER_CONTEXT_QUEUE;
+	  ipc_connection_invoke_batch(handler, function, ctx, batch, count);
+	  ipc_handler_context = IPC_HANDLER_CONTEXT_NONE;
+	  ipc_connection_release_batch(batch, count);
+	  ipc_connection_delivered(conn, count, bytes);
+	  ipc_connection_release(conn);
+	});
+}
+
+static void ipc_connection_batch_append(struct ipc_connection *conn, ipc_object_t result, const struct ipc_frame_header *header)
+{
+	if (ipc_connection_event_stale(conn, header->id, header->spare[0]))
+	{
+		return;
+	}
+
+	if (conn->xc_recv_batch == NULL && (conn->xc_recv_batch = malloc(conn->xc_recv_batch_max * sizeof(ipc_object_t))) == NULL)
+	{
+		debugf("cannot allocate batch, dropping message");
+		return;
+	}
+
+	conn->xc_recv_batch[conn->xc_recv_batch_len++] = ipc_retain(result);
+	conn->xc_recv_batch_bytes += (size_t)header->length;
+
+	if (conn->xc_recv_batch_len == conn->xc_recv_batch_max)
+	{
+		ipc_connection_flush_batch(conn);
+	}
+}
+
+static void ipc_connection_deliver(struct ipc_connection *conn, struct ipc_frame_header *header, ipc_object_t result)
+{
+	struct ipc_pending_call *call = NULL;
+
+	/* The call leaves the table here, so a duplicate reply cannot run the handler twice */
+	if (header->flags & IPC_FRAME_REPLY)
+	{
+		if ((call = ipc_connection_pending_remove(conn, header->id)) == NULL)
+		{
+			debugf("dropping reply to unknown or expired call id=%llu", header->id);
+			return;
+		}
+	}
+	else if (ipc_get_type(result) == IPC_TYPE_DICTIONARY)
+	{
+		/* Kept out of the payload, so forwarding the message does not carry them along */
+		((struct ipc_object *)result)->xo_dict.xd_id = header->id;
+		((struct ipc_object *)result)->xo_dict.xd_deadline = header->spare[0];
+	}
+
+	if (call == NULL && (conn->xc_batch_handler != NULL || conn->xc_batch_handler_f != NULL))
+	{
+		ipc_connection_batch_append(conn, result, header);
+		return;
+	}
+
+	if (conn->xc_inline_delivery)
+	{
+		ipc_connection_dispatch_inline(conn, result, call, header);
+		return;
+	}
+
+	ipc_connection_dispatch_callback(conn, result, call, header);
+}
+
+static int ipc_connection_drain_shm(struct ipc_connection *conn)
+{
+	struct ipc_frame_header header;
+	const void *payload;
+	ipc_object_t result;
+	int ret;
+
+	do
+	{
+		while ((ret = shm_peek(conn->xc_shm_rx, &header, &payload)) > 0)
+		{
+			header.spare[0] = ipc_deadline_from_wire(header.spare[0]);
+			if (ipc_frame_expired(&header))
+			{
+				debugf("dropping expired call, id=%llu", header.id);
+				shm_consume(conn->xc_shm_rx);
+				continue;
+			}
+
+			result = ipc_pipe_unpack(payload, (size_t)header.length, NULL);
+			shm_consume(conn->xc_shm_rx);
+
+			if (result == NULL)
+			{
+				debugf("dropping undecodable frame, id=%llu", header.id);
+				continue;
+			}
+
+			ipc_connection_deliver(conn, &header, result);
+			ipc_release(result);
+		}
+
+		if (ret < 0)
+		{
+			return (-1);
+		}
+	} while (!shm_idle(conn->xc_shm_rx));
+
+	return (0);
+}
+
+static int ipc_connection_attach_shm(struct ipc_connection *conn)
+{
+	struct ipc_shm *shm;
+	int fd;
+
+	if ((fd = ipc_pipe_take_fd(&conn->xc_recv_fds)) == -1)
+	{
+		debugf("shared memory setup without a descriptor");
+		return (0);
+	}
+
+	/* Only listeners created as shared memory services accept rings */
+	if (conn->xc_parent == NULL || (conn->xc_parent->xc_flags & _IPC_CONNECTION_SHM) == 0 || conn->xc_shm_rx != NULL)
+	{
+		close(fd);
+		return (0);
+	}
+
+	if (shm_attach(fd, &shm) != 0)
+	{
+		debugf("Cannot attach shared memory: %s", strerror(errno));
+		close(fd);
+		return (0);
+	}
+
+	close(fd);
+	conn->xc_shm_rx = shm;
+	dispatch_async(conn->xc_send_queue, ^{
+	  conn->xc_shm_tx = shm;
+	});
+
+	return (0);
+}
+
+static int ipc_connection_handle_frame(struct ipc_connection *conn, struct ipc_frame_header *header, ipc_object_t result)
+{
+	if (header->flags & IPC_FRAME_SHM_SETUP)
+	{
+		return (header->nfds == 1 ? ipc_connection_attach_shm(conn) : 0);
+	}
+
+	if (header->flags & IPC_FRAME_DOORBELL)
+	{
+		return (conn->xc_shm_rx ? ipc_connection_drain_shm(conn) : 0);
+	}
+
+	if (header->flags & IPC_FRAME_CANCEL)
+	{
+		debugf("call id=%llu cancelled by the peer", header->id);
+		atomic_store_explicit(&conn->xc_cancelled[header->id & (IPC_CANCEL_SLOTS - 1)], header->id, memory_order_relaxed);
+		return (0);
+	}
+
+	/* Only the last piece of a fragmented message carries it */
+	if (header->flags & IPC_FRAME_FRAGMENT)
+	{
+		return (0);
+	}
+
+	if (result == NULL && header->spare[0] == 0)
+	{
+		debugf("dropping undecodable frame, id=%llu", header->id);
+	}
+
+	if (header->seq == 0 || conn->xc_shm_rx == NULL)
+	{
+		if (result != NULL)
+		{
+			debugf("msg=%p, id=%llu", result, header->id);
+			ipc_connection_deliver(conn, header, result);
+		}
+		return (0);
+	}
+
+	/* Ring frames sequenced before this socket frame are delivered first */
+	if (ipc_connection_drain_shm(conn) != 0)
+	{
+		return (-1);
+	}
+
+	/* Even a dropped frame holds its place in the ring's sequence */
+	shm_skip(conn->xc_shm_rx, header->seq);
+	if (result != NULL)
+	{
+		ipc_connection_deliver(conn, header, result);
+	}
+
+	return (ipc_connection_drain_shm(conn));
+}
+
+static void ipc_connection_read(struct ipc_connection *conn)
+{
+	struct ipc_frame_header header;
+	ipc_object_t result;
+	size_t pending, received = 0;
+	ssize_t ret;
+	int status, error;
+
+	/*
+	 * The read source reports how many bytes were readable when it fired.
+	 * Reading stops once that much is consumed instead of probing for
+	 * EAGAIN: the source is level triggered and fires again for newer data.
+	 */
+	pending = dispatch_source_get_data(conn->xc_recv_source);
+
+	/* Listeners use this to find idle peers */
+	if (conn->xc_parent != NULL)
+	{
+		atomic_store_explicit(&conn->xc_last_active, ipc_monotonic_time(), memory_order_relaxed);
+	}
+
+	/* Drain the socket, decoding every complete frame before reading more */
+	do
+	{
+		ret = ipc_pipe_receive(conn->xc_local_port, &conn->xc_recv_buffer, &conn->xc_recv_fds);
+		error = (ret < 0) ? errno : 0;
+		received += (ret > 0) ? (size_t)ret : 0;
+
+		while ((status = ipc_pipe_next_frame(&conn->xc_recv_buffer, &conn->xc_recv_fds, &conn->xc_recv_partial, &header, &result)) > 0)
+		{
+			status = ipc_connection_handle_frame(conn, &header, result);
+
+			if (result != NULL)
+			{
+				ipc_release(result);
+			}
+
+			if (status < 0)
+			{
+				break;
+			}
+		}
+
+		if (status < 0)
+		{
+			debugf("framing error: %s", strerror(errno));
+			dispatch_source_cancel(conn->xc_recv_source);
+			return;
+		}
+
+		/* Leave the rest in the socket until the handlers catch up */
+		if (ipc_connection_pause_recv(conn))
+		{
+			return;
+		}
+	} while (ret > 0 && (pending == 0 || received < pending));
+
+	if (ret > 0 || (ret < 0 && error == EAGAIN))
+	{
+		return;
+	}
+
+	dispatch_source_cancel(conn->xc_recv_source);
+}
+
+void ipc_connection_recv_message(void *context)
+{
+	struct ipc_connection *conn = context;
+
+	debugf("connection=%p", context);
 
-	debugf("msg=%p, id=%llu", result, id);
+	ipc_connection_read(conn);
 
-	ipc_connection_dispatch_callback(conn, result, id);
-	ipc_release(result);
+	/* Whatever one pass decoded reaches the batch handler together */
+	ipc_connection_flush_batch(conn);
 }
@@ -17,33 +17,141 @@ __BEGIN_DECLS
     IPC_GLOBAL_OBJECT(_ipc_error_connection_invalid)
 IPC_EXPORT const struct _ipc_dictionary_s _ipc_error_connection_invalid;
 
+#define IPC_ERROR_TIMEOUT \
+    IPC_GLOBAL_OBJECT(_ipc_error_timeout)
+IPC_EXPORT const struct _ipc_dictionary_s _ipc_error_timeout;
+
+#define IPC_ERROR_CANCELLED \
+    IPC_GLOBAL_OBJECT(_ipc_error_cancelled)
+IPC_EXPORT const struct _ipc_dictionary_s _ipc_error_cancelled;
+
 #define IPC_CONNECTION_CLIENT (0)
 #define IPC_CONNECTION_LISTENER (1 << 0)
 
+#define IPC_HANDLER_CONTEXT_NONE (0)
+#define IPC_HANDLER_CONTEXT_QUEUE (1)
+#define IPC_HANDLER_CONTEXT_INLINE (2)
+
+#define IPC_PRIORITY_DEFAULT (0)
+#define IPC_PRIORITY_HIGH (1)
+
 typedef void (*ipc_finalizer_t)(void *value);
 
+typedef void (*ipc_handler_function_t)(void *context, ipc_object_t object);
+
+typedef void (^ipc_watermark_handler_t)(bool above);
+
+typedef void (*ipc_watermark_function_t)(void *context, bool above);
+
+typedef bool (^ipc_connection_applier_t)(ipc_connection_t peer);
+
+typedef bool (*ipc_connection_applier_function_t)(void *context, ipc_connection_t peer);
+
+typedef void (^ipc_batch_handler_t)(ipc_object_t *messages, size_t count);
+
+typedef void (*ipc_batch_handler_function_t)(void *context, ipc_object_t *messages, size_t count);
+
+struct ipc_connection_statistics {
+    uint64_t messages_sent;
+    uint64_t bytes_sent;
+    uint64_t send_batches;
+    uint64_t max_batch_size;
+};
+
+struct ipc_listener_statistics {
+    uint64_t accept_wakeups;
+    uint64_t accepted;
+    uint64_t max_accepts_per_wakeup;
+    uint64_t queue_overflows;
+    uint64_t accept_errors;
+    uint64_t idle_reaped;
+    uint64_t evicted;
+};
+
 ipc_connection_t ipc_connection_create(dispatch_queue_t targetq);
 
 ipc_connection_t ipc_connection_create_domain_socket_service(const char *path, dispatch_queue_t targetq, uint64_t flags);
 
 ipc_connection_t ipc_connection_create_socket_service(const char *ip, uint16_t port, dispatch_queue_t targetq, uint64_t flags);
 
+ipc_connection_t ipc_connection_create_shm_service(const char *path, dispatch_queue_t targetq, uint64_t flags);
+
 void ipc_connection_set_target_queue(ipc_connection_t connection, dispatch_queue_t targetq);
 
 void ipc_connection_set_event_handler(ipc_connection_t connection, ipc_handler_t handler);
 
+void ipc_connection_set_event_handler_f(ipc_connection_t connection, ipc_handler_function_t handler);
+
+void ipc_connection_set_batch_event_handler(ipc_connection_t connection, size_t max_batch, ipc_batch_handler_t handler);
+
+void ipc_connection_set_batch_event_handler_f(ipc_connection_t connection, size_t max_batch, ipc_batch_handler_function_t handler);
+
 void ipc_connection_suspend(ipc_connection_t connection);
 
 void ipc_connection_resume(ipc_connection_t connection);
 
 void ipc_connection_send_message(ipc_connection_t connection, ipc_object_t message);
 
+void ipc_connection_send_message_with_priority(ipc_connection_t connection, ipc_object_t message, int priority);
+
+int ipc_connection_try_send_message(ipc_connection_t connection, ipc_object_t message);
+
 void ipc_connection_send_barrier(ipc_connection_t connection, dispatch_block_t barrier);
 
-void ipc_connection_send_message_with_reply(ipc_connection_t connection, ipc_object_t message, dispatch_queue_t replyq, ipc_handler_t handler);
+uint64_t ipc_connection_send_message_with_reply(ipc_connection_t connection, ipc_object_t message, dispatch_queue_t replyq, ipc_handler_t handler);
+
+uint64_t ipc_connection_send_message_with_reply_f(ipc_connection_t connection, ipc_object_t message, dispatch_queue_t replyq, void *context, ipc_handler_function_t handler);
+
+uint64_t ipc_connection_send_message_with_reply_timeout(ipc_connection_t connection, ipc_object_t message, dispatch_queue_t replyq, uint64_t timeout, ipc_handler_t handler);
+
+uint64_t ipc_connection_send_message_with_reply_timeout_f(ipc_connection_t connection, ipc_object_t message, dispatch_queue_t replyq, uint64_t timeout, void *context, ipc_handler_function_t handler);
 
 ipc_object_t ipc_connection_send_message_with_reply_sync(ipc_connection_t connection, ipc_object_t message);
 
+void ipc_connection_cancel_reply(ipc_connection_t connection, uint64_t call);
+
+bool ipc_connection_call_cancelled(ipc_connection_t connection, ipc_object_t message);
+
+void ipc_connection_set_listen_backlog(ipc_connection_t listener, int backlog);
+
+void ipc_connection_get_listener_statistics(ipc_connection_t listener, struct ipc_listener_statistics *stats);
+
+void ipc_connection_set_listener_shards(ipc_connection_t listener, unsigned int shards);
+
+void ipc_connection_set_listener_workers(ipc_connection_t listener, unsigned int width);
+
+void ipc_connection_set_listener_fair_queueing(ipc_connection_t listener, bool enable);
+
+void ipc_connection_set_idle_timeout(ipc_connection_t listener, uint64_t timeout);
+
+void ipc_connection_set_max_peers(ipc_connection_t listener, size_t max_peers);
+
+void ipc_connection_set_weight(ipc_connection_t connection, unsigned int weight);
+
+size_t ipc_connection_get_queue_depth(ipc_connection_t connection);
+
+bool ipc_connection_apply_peers(ipc_connection_t listener, ipc_connection_applier_t applier);
+
+bool ipc_connection_apply_peers_f(ipc_connection_t listener, void *context, ipc_connection_applier_function_t applier);
+
+void ipc_connection_set_send_coalescing(ipc_connection_t connection, uint64_t latency, size_t max_bytes);
+
+void ipc_connection_set_send_watermarks(ipc_connection_t connection, size_t low, size_t high, size_t limit);
+
+void ipc_connection_set_watermark_handler(ipc_connection_t connection, ipc_watermark_handler_t handler);
+
+void ipc_connection_set_watermark_handler_f(ipc_connection_t connection, ipc_watermark_function_t handler);
+
+void ipc_connection_set_inline_delivery(ipc_connection_t connection, bool enable);
+
+int ipc_connection_get_handler_context(void);
+
+void ipc_connection_set_reply_timeout(ipc_connection_t connection, uint64_t timeout);
+
+void ipc_connection_set_recv_limit(ipc_connection_t connection, size_t messages, size_t bytes);
+
+void ipc_connection_get_statistics(ipc_connection_t connection, struct ipc_connection_statistics *stats);
+
 void ipc_connection_cancel(ipc_connection_t connection);
 
 void ipc_connection_set_context(ipc_connection_t connection, void *context);
@@ -11,11 +11,146 @@
 #include "ipc_array.h"
 #include "mpack.h"
 
+/*
+ * Entries live in one array in insertion order, so iteration and encoding
+ * keep the order keys were added in. The array doubles from
+ * IPC_DICT_MIN_CAPACITY, which makes its capacity a function of the count.
+ * Small dictionaries are scanned; past IPC_DICT_INDEX_MIN entries an
+ * open-addressing index of entry numbers, at most half full, finds keys.
+ */
+static size_t ipc_dictionary_hash(const char *key, size_t len)
+{
+    size_t hash = 2166136261u;
+
+    while (len--)
+        hash = (hash ^ (uint8_t)*key++) * 16777619u;
+
+    return (hash);
+}
+
+static size_t ipc_dictionary_capacity(size_t count)
+{
+    size_t capacity = IPC_DICT_MIN_CAPACITY;
+
+    while (capacity < count)
+        capacity <<= 1;
+
+    return (capacity);
+}
+
+static void ipc_dictionary_index_place(struct ipc_object *xo, size_t n)
+{
+    size_t mask = ipc_dictionary_capacity(xo->xo_size) * 2 - 1;
+    size_t i;
+
+    for (i = xo->xo_dict.xd_entries[n].de_hash & mask; xo->xo_dict.xd_index[i] != 0; i = (i + 1) & mask)
+        ;
+
+    xo->xo_dict.xd_index[i] = (uint32_t)n + 1;
+}
+
+static void ipc_dictionary_reindex(struct ipc_object *xo)
+{
+    size_t i;
+
+    /* Without an index lookups fall back to scanning, which is slower but still correct */
+    free(xo->xo_dict.xd_index);
+    xo->xo_dict.xd_index = calloc(ipc_dictionary_capacity(xo->xo_size) * 2, sizeof(uint32_t));
+    if (xo->xo_dict.xd_index == NULL)
+        return;
+
+    for (i = 0; i < xo->xo_size; i++)
+        ipc_dictionary_index_place(xo, i);
+}
+
+static struct ipc_dict_entry *ipc_dictionary_lookup(struct ipc_object *xo, const char *key, size_t len, size_t hash)
+{
+    struct ipc_dict_entry *entry;
+    size_t mask, i;
+
+    if (xo->xo_dict.xd_index != NULL)
+    {
+        mask = ipc_dictionary_capacity(xo->xo_size) * 2 - 1;
+        for (i = hash & mask; xo->xo_dict.xd_index[i] != 0; i = (i + 1) & mask)
+        {
+            entry = &xo->xo_dict.xd_entries[xo->xo_dict.xd_index[i] - 1];
+            if (entry->de_hash == hash && !strncmp(entry->de_key, key, len) && entry->de_key[len] == '\0')
+                return (entry);
+        }
+
+        return (NULL);
+    }
+
+    for (i = 0; i < xo->xo_size; i++)
+    {
+        entry = &xo->xo_dict.xd_entries[i];
+        if (entry->de_hash == hash && !strncmp(entry->de_key, key, len) && entry->de_key[len] == '\0')
+            return (entry);
+    }
+
+    return (NULL);
+}
+
+/* The dictionary takes over the caller's reference to value, as it always has */
+static void ipc_dictionary_insert(struct ipc_object *xo, const char *key, size_t len, ipc_object_t value)
+{
+    struct ipc_dict_entry *entries, *entry;
+    size_t hash = ipc_dictionary_hash(key, len);
+    size_t count = xo->xo_size;
+    bool grown = false;
+
+    if ((entry = ipc_dictionary_lookup(xo, key, len, hash)) != NULL)
+    {
+        /* The replaced value was leaked before */
+        if (entry->de_value != value)
+            ipc_release(entry->de_value);
+        entry->de_value = value;
+        return;
+    }
+
+    if (xo->xo_dict.xd_entries == NULL || count == ipc_dictionary_capacity(count))
+    {
+        entries = realloc(xo->xo_dict.xd_entries, (count ? count * 2 : IPC_DICT_MIN_CAPACITY) * sizeof(*entries));
+        if (entries == NULL)
+        {
+            debugf("cannot grow dictionary, dropping key %s", key);
+            ipc_release(value);
+            return;
+        }
+
+        xo->xo_dict.xd_entries = entries;
+        grown = true;
+    }
+
+    entry = &xo->xo_dict.xd_entries[count];
+    if ((entry->de_key = malloc(len + 1)) == NULL)
+    {
+        ipc_release(value);
+        return;
+    }
+
+    memcpy(entry->de_key, key, len);
+    entry->de_key[len] = '\0';
+    entry->de_hash = hash;
+    entry->de_value = value;
+    xo->xo_size++;
+
+    if (xo->xo_size <= IPC_DICT_INDEX_MIN)
+        return;
+
+    if (xo->xo_dict.xd_index == NULL || grown)
+        ipc_dictionary_reindex(xo);
+    else
+        ipc_dictionary_index_place(xo, count);
+}
+
 struct ipc_object *mpack2xpc(const mpack_node_t node)
 {
     ipc_object_t xotmp;
+    struct ipc_buffer *fds;
     size_t i;
     ipc_u val;
+    int fd;
 
     switch (mpack_node_type(node))
     {
@@ -60,11 +195,16 @@ struct ipc_object *mpack2xpc(const mpack_node_t node)
 
     case mpack_type_array:
         xotmp = ipc_array_create(NULL, 0);
+        _ipc_array_reserve(xotmp, mpack_node_array_length(node));
         for (i = 0; i < mpack_node_array_length(node); i++)
         {
             ipc_object_t item = mpack2xpc(
                 mpack_node_array_at(node, i));
-            ipc_array_append_value(item, xotmp);
+            if (item == NULL)
+                continue;
+
+            ipc_array_append_value(xotmp, item);
+            ipc_release(item);
         }
         break;
 
@@ -73,16 +213,32 @@ struct ipc_object *mpack2xpc(const mpack_node_t node)
         xotmp = ipc_dictionary_create(NULL, NULL, 0);
         for (i = 0; i < mpack_node_map_count(node); i++)
         {
+            /* Keys are hashed and copied straight out of the message */
             mpack_node_t key_node = mpack_node_map_key_at(node, i);
-            size_t len = mpack_node_data_len(key_node);
-            char *key = mpack_node_cstr_alloc(key_node, len + 1);
-            ipc_object_t value = mpack2xpc(
-                mpack_node_map_value_at(node, i));
-            ipc_dictionary_set_value(xotmp, key, value);
-            free(key);
+            size_t len = mpack_node_strlen(key_node);
+            const char *key = mpack_node_str(key_node);
+            ipc_object_t value;
+
+            if (key == NULL || memchr(key, '\0', len) != NULL)
+                continue;
+
+            if ((value = mpack2xpc(mpack_node_map_value_at(node, i))) != NULL)
+                ipc_dictionary_insert(xotmp, key, len, value);
         }
     }
     break;
+
+    case mpack_type_ext:
+        xotmp = NULL;
+        fds = mpack_tree_context(node.tree);
+        if (mpack_node_exttype(node) != IPC_MPACK_EXT_SHMEM || mpack_node_data_len(node) != sizeof(uint64_t))
+            break;
+
+        /* Descriptors are claimed in the order the encoder met the objects */
+        if (fds != NULL && (fd = ipc_pipe_take_fd(fds)) != -1)
+            xotmp = _ipc_shmem_import(fd, (size_t)mpack_load_u64(mpack_node_data(node)));
+        break;
+
     default:
         xotmp = NULL;
         break;
@@ -94,6 +250,8 @@ struct ipc_object *mpack2xpc(const mpack_node_t node)
 void xpc2mpack(mpack_writer_t *writer, ipc_object_t obj)
 {
     struct ipc_object *xotmp = obj;
+    struct ipc_pack_context *ctx;
+    char length[sizeof(uint64_t)];
 
     switch (xotmp->xo_ipc_type)
     {
@@ -113,7 +271,7 @@ void xpc2mpack(mpack_writer_t *writer, ipc_object_t obj)
           xpc2mpack(writer, v);
           return ((bool)true);
         });
-        mpack_finish_map(writer);
+        mpack_finish_array(writer);
         break;
 
     case _IPC_TYPE_NULL:
@@ -142,6 +300,18 @@ void xpc2mpack(mpack_writer_t *writer, ipc_object_t obj)
     case _IPC_TYPE_DATA:
         mpack_write_bin(writer, ipc_data_get_bytes_ptr(obj), (uint32_t)ipc_data_get_length(obj));
         break;
+
+    case _IPC_TYPE_SHMEM:
+        ctx = mpack_writer_context(writer);
+        if (ctx == NULL || ipc_buffer_append(ctx->pc_fds, &xotmp->xo_shmem.fd, sizeof(int)) != 0)
+        {
+            mpack_writer_flag_error(writer, mpack_error_memory);
+            break;
+        }
+
+        mpack_store_u64(length, xotmp->xo_size);
+        mpack_write_ext(writer, IPC_MPACK_EXT_SHMEM, length, sizeof(length));
+        break;
     }
 }
 
@@ -151,7 +321,7 @@ ipc_object_t ipc_dictionary_create(char *const *keys, const ipc_object_t *values
     size_t i;
     ipc_u val = {0};
 
-    xo = _ipc_prim_create(_IPC_TYPE_DICTIONARY, val, count);
+    xo = _ipc_prim_create(_IPC_TYPE_DICTIONARY, val, 0);
 
     for (i = 0; i < count; i++)
     {
@@ -163,56 +333,53 @@ ipc_object_t ipc_dictionary_create(char *const *keys, const ipc_object_t *values
 ipc_object_t ipc_dictionary_create_reply(ipc_object_t original)
 {
     struct ipc_object *xo_orig;
+    struct ipc_object *reply;
 
     xo_orig = original;
     if ((xo_orig->xo_flags & _IPC_FROM_WIRE) == 0)
         return (NULL);
 
-    return ipc_dictionary_create(NULL, NULL, 0);
+    /* Only a reply made here goes out as one, a forwarded message is a new call */
+    if ((reply = ipc_dictionary_create(NULL, NULL, 0)) == NULL)
+        return (NULL);
+
+    reply->xo_flags |= _IPC_REPLY;
+    reply->xo_dict.xd_id = xo_orig->xo_dict.xd_id;
+    return (reply);
 }
 
-void ipc_dictionary_set_value(ipc_object_t xdict, char *key, ipc_object_t value)
+/*
+ * Nanoseconds left until the caller of a received call gives up on it:
+ * UINT64_MAX when the caller set no deadline, 0 once it has passed.
+ */
+uint64_t ipc_dictionary_get_remaining_time(ipc_object_t original)
 {
-    struct ipc_object *xo;
-    struct ipc_dict_head *head;
-    struct ipc_dict_pair *pair;
+    struct ipc_object *xo = original;
+    uint64_t deadline, now;
 
-    xo = xdict;
-    head = &xo->xo_dict;
+    if (xo->xo_ipc_type != _IPC_TYPE_DICTIONARY)
+        return (UINT64_MAX);
 
-    TAILQ_FOREACH(pair, head, xo_link)
-    {
-        if (!strcmp(pair->key, key))
-        {
-            pair->value = value;
-            return;
-        }
-    }
+    if ((deadline = xo->xo_dict.xd_deadline) == 0)
+        return (UINT64_MAX);
 
-    xo->xo_size++;
-    pair = malloc(sizeof(struct ipc_dict_pair));
-    pair->key = strdup(key);
-    pair->value = value;
-    TAILQ_INSERT_TAIL(&xo->xo_dict, pair, xo_link);
+    now = ipc_monotonic_time();
+    return (deadline > now ? deadline - now : 0);
+}
+
+void ipc_dictionary_set_value(ipc_object_t xdict, char *key, ipc_object_t value)
+{
+    ipc_dictionary_insert(xdict, key, strlen(key), value);
 }
 
 ipc_object_t
 ipc_dictionary_get_value(ipc_object_t xdict, char *key)
 {
-    struct ipc_object *xo;
-    struct ipc_dict_head *head;
-    struct ipc_dict_pair *pair;
-
-    xo = xdict;
-    head = &xo->xo_dict;
+    struct ipc_dict_entry *entry;
+    size_t len = strlen(key);
 
-    TAILQ_FOREACH(pair, head, xo_link)
-    {
-        if (!strcmp(pair->key, key))
-            return (pair->value);
-    }
-
-    return (NULL);
+    entry = ipc_dictionary_lookup(xdict, key, len, ipc_dictionary_hash(key, len));
+    return (entry ? entry->de_value : NULL);
 }
 
 size_t ipc_dictionary_get_count(ipc_object_t xdict)
@@ -356,15 +523,13 @@ double ipc_dictionary_get_double(ipc_object_t xdict, char *key)
 bool ipc_dictionary_apply(ipc_object_t xdict, ipc_dictionary_applier_t applier)
 {
     struct ipc_object *xo;
-    struct ipc_dict_head *head;
-    struct ipc_dict_pair *pair;
+    size_t i;
 
     xo = xdict;
-    head = &xo->xo_dict;
 
-    TAILQ_FOREACH(pair, head, xo_link)
+    for (i = 0; i < xo->xo_size; i++)
     {
-        if (!applier(pair->key, pair->value))
+        if (!applier(xo->xo_dict.xd_entries[i].de_key, xo->xo_dict.xd_entries[i].de_value))
             return (false);
     }
 
@@ -20,6 +20,8 @@ ipc_object_t ipc_dictionary_create(char * const *keys, const ipc_object_t *value
 
 ipc_object_t ipc_dictionary_create_reply(ipc_object_t original);
 
+uint64_t ipc_dictionary_get_remaining_time(ipc_object_t original);
+
 void ipc_dictionary_set_value(ipc_object_t xdict, char *key, ipc_object_t value);
 
 ipc_object_t ipc_dictionary_get_value(ipc_object_t xdict, char *key);
@@ -11,8 +11,16 @@
 
 #include <sys/queue.h>
 #include <sys/uio.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <dispatch/dispatch.h>
 #include "mpack.h"
+#include "ipc_connection.h"
+
+#if !MPACK_EXTENSIONS
+#error "shared memory objects are encoded as MPack extension types, build with MPACK_EXTENSIONS=1"
+#endif
 
 __BEGIN_DECLS
 
@@ -38,24 +46,34 @@ __BEGIN_DECLS
 #define _IPC_TYPE_DATA			11
 #define _IPC_TYPE_STRING		12
 #define _IPC_TYPE_UUID			13
+#define _IPC_TYPE_SHMEM			14
 #define _IPC_TYPE_ERROR			16
 #define _IPC_TYPE_DOUBLE		17
 #define _IPC_TYPE_MAX			_IPC_TYPE_DOUBLE
 
-#define	IPC_SEQID		"IPC sequence number"
 #define	IPC_PROTOCOL_VERSION	1
 
 struct ipc_object;
-struct ipc_dict_pair;
+struct ipc_dict_entry;
+struct ipc_shm;
+
+struct ipc_array {
+	struct ipc_object **	xa_items;
+	size_t			xa_capacity;
+};
 
-TAILQ_HEAD(ipc_dict_head, ipc_dict_pair);
-TAILQ_HEAD(ipc_array_head, ipc_object);
+struct ipc_dict {
+	struct ipc_dict_entry *	xd_entries;
+	uint32_t *		xd_index;
+	uint64_t		xd_id;		/* the call it carries, or answers if _IPC_REPLY */
+	uint64_t		xd_deadline;	/* local deadline of a received call, 0 for none */
+};
 
 typedef uintptr_t ipc_port_t;
 
 typedef union {
-	struct ipc_dict_head dict;
-	struct ipc_array_head array;
+	struct ipc_dict dict;
+	struct ipc_array array;
 	uint64_t ui;
 	int64_t i;
 	char *str;
@@ -63,16 +81,102 @@ typedef union {
 	double d;
 	uintptr_t ptr;
 	uuid_t uuid;
+	struct {
+		void *addr;
+		int fd;
+	} shmem;
 } ipc_u;
 
 struct ipc_frame_header {
     uint64_t version;
     uint64_t id;
     uint64_t length;
-    uint64_t spare[4];
+    uint64_t flags;
+    uint64_t seq;
+    uint64_t nfds;
+    uint64_t spare[1];		/* spare[0]: nanoseconds left for a call, 0 for none */
 };
 
+#define IPC_FRAME_SHM_SETUP	0x1	/* carries the shared memory descriptor */
+#define IPC_FRAME_DOORBELL	0x2	/* the peer's ring went from empty to non-empty */
+#define IPC_FRAME_PAD		0x4	/* ring filler up to the end of the ring */
+#define IPC_FRAME_REPLY		0x8	/* answers the peer's call with the same id */
+#define IPC_FRAME_FRAGMENT	0x10	/* one piece of a message too large to send in one go */
+#define IPC_FRAME_FRAGMENT_END	0x20	/* the last piece, the message is complete */
+#define IPC_FRAME_HIGH		0x40	/* delivered ahead of default priority messages */
+#define IPC_FRAME_CANCEL	0x80	/* the caller no longer waits for the call with this id */
+
 #define _IPC_FROM_WIRE 0x1
+#define _IPC_REPLY 0x2
+
+#define IPC_MPACK_EXT_SHMEM	1	/* big endian length, descriptor travels with the frame */
+
+#define _IPC_CONNECTION_SHM	(1ULL << 32)
+
+#define IPC_MAX_FDS		16
+
+#define IPC_LISTEN_BACKLOG	SOMAXCONN
+
+#define IPC_RECV_BUFFER_SIZE	65536
+#define IPC_SEND_BUFFER_SIZE	65536
+#define IPC_SEND_BUFFER_RETAIN_SIZE	(4 * 1024 * 1024)
+#define IPC_SEND_QUEUE_LIMIT	(2 * IPC_MAX_FRAME_SIZE)	/* a largest legal frame always fits */
+#define IPC_RECV_INFLIGHT_LIMIT	1024
+#define IPC_RECV_INFLIGHT_BYTES	(16 * 1024 * 1024)
+#define IPC_PENDING_BUCKETS	64
+#define IPC_PENDING_POOL_MAX	256
+#define IPC_OP_POOL_MAX		1024
+#define IPC_SCHED_QUANTUM	4096
+#define IPC_SCHED_MESSAGE_COST	256	/* charged on top of the payload, so tiny messages are not free */
+#define IPC_SCHED_BATCH		64
+#define IPC_LANE_HIGH		0
+#define IPC_LANE_DEFAULT	1
+#define IPC_LANES		2
+#define IPC_TIMER_WHEEL_SLOTS	512
+#define IPC_PEER_TABLE_SLOTS	64
+#define IPC_DICT_MIN_CAPACITY	4
+#define IPC_ARRAY_MIN_CAPACITY	4
+#define IPC_DICT_INDEX_MIN	8
+#define IPC_REAP_INTERVAL_MIN	NSEC_PER_SEC
+#define IPC_SYNC_SPIN		4096
+#define IPC_CANCEL_SLOTS	64
+#define IPC_RECV_BATCH_MAX	64
+#define IPC_TIMER_TICK		(10 * NSEC_PER_MSEC)
+#define IPC_MAX_FRAME_SIZE	(256 * 1024 * 1024)
+#define IPC_FRAGMENT_SIZE	(64 * 1024)
+
+/* Spin wait hint, lets a sibling hardware thread run and saves power */
+#if defined(__x86_64__) || defined(__i386__)
+#define IPC_CPU_RELAX()		__builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define IPC_CPU_RELAX()		__asm__ __volatile__("yield" ::: "memory")
+#else
+#define IPC_CPU_RELAX()		do { } while (0)
+#endif
+
+struct ipc_buffer {
+	char *			ib_data;
+	size_t			ib_offset;
+	size_t			ib_length;
+	size_t			ib_capacity;
+};
+
+/*
+ * A message queued for the socket, failed by id if the send side is lost.
+ * Its header is restamped with the time left until it starts going out.
+ */
+struct ipc_send_record {
+	uint64_t		xs_id;
+	uint64_t		xs_flags;
+	uint64_t		xs_deadline;
+	size_t			xs_start;
+	size_t			xs_end;
+};
+
+struct ipc_pack_context {
+	struct ipc_buffer *	pc_data;
+	struct ipc_buffer *	pc_fds;
+};
 
 struct ipc_object {
 	uint8_t			xo_ipc_type;
@@ -80,39 +184,166 @@ struct ipc_object {
 	volatile uint32_t	xo_refcnt;
 	size_t			xo_size;
 	ipc_u			xo_u;
-	TAILQ_ENTRY(ipc_object) xo_link;
 };
 
-struct ipc_dict_pair {
-	char *		key;
-	struct ipc_object *	value;
-	TAILQ_ENTRY(ipc_dict_pair) xo_link;
+struct ipc_dict_entry {
+	size_t			de_hash;
+	char *			de_key;
+	struct ipc_object *	de_value;
+};
+
+#define IPC_SYNC_PENDING	0
+#define IPC_SYNC_SLEEPING	1
+#define IPC_SYNC_DONE		2
+
+struct ipc_sync_waiter {
+	_Atomic int		sw_state;
+	ipc_object_t		sw_result;
+	dispatch_semaphore_t	sw_sem;
 };
 
 struct ipc_pending_call {
 	uint64_t		xp_id;
-	ipc_object_t		xp_response;
+	uint64_t		xp_deadline;
 	dispatch_queue_t	xp_queue;
 	ipc_handler_t		xp_handler;
-	TAILQ_ENTRY(ipc_pending_call) xp_link;
+	ipc_handler_function_t	xp_function;
+	void *			xp_context;
+	struct ipc_sync_waiter * xp_waiter;
+	struct ipc_pending_call * xp_next;
+	TAILQ_ENTRY(ipc_pending_call) xp_timer_link;
+};
+
+TAILQ_HEAD(ipc_pending_timers, ipc_pending_call);
+
+struct ipc_connection_op {
+	struct ipc_connection *	xq_conn;
+	ipc_object_t		xq_object;
+	struct ipc_pending_call * xq_call;
+	uint64_t		xq_id;
+	uint64_t		xq_flags;
+	uint64_t		xq_deadline;
+	size_t			xq_size;
+	int			xq_lane;
+	struct ipc_connection_op * xq_next;
+};
+
+/* Work for a peer under listener workers, run when the peer holds a slot */
+struct ipc_work {
+	dispatch_function_t	xw_function;
+	void *			xw_context;
+	struct ipc_work *	xw_next;
 };
 
 struct ipc_connection {
 	ipc_port_t		xc_local_port;
 	ipc_handler_t		xc_handler;
+	ipc_handler_function_t	xc_handler_f;
+	ipc_finalizer_t		xc_finalizer;
 	dispatch_source_t	xc_recv_source;
 	dispatch_queue_t	 xc_send_queue;
 	dispatch_queue_t	 xc_recv_queue;
 	dispatch_queue_t	 xc_target_queue;
+	dispatch_queue_t	 xc_peer_queue;
+	_Atomic unsigned int	xc_refcount;
+	bool			xc_resumed;
 	int			xc_suspend_count;
 	int			xc_transaction_count;
 	uint64_t		xc_flags;
 	volatile uint64_t	xc_last_id;
 	void *			xc_context;
 	struct ipc_connection * xc_parent;
-	TAILQ_HEAD(, ipc_pending_call) xc_pending;
-	TAILQ_HEAD(, ipc_connection) xc_peers;
-	TAILQ_ENTRY(ipc_connection) xc_link;
+	struct ipc_buffer	xc_recv_buffer;
+	struct ipc_buffer	xc_recv_fds;
+	struct ipc_buffer	xc_send_buffer;
+	struct ipc_buffer	xc_send_fds;
+	struct ipc_buffer	xc_recv_partial;
+	struct ipc_buffer	xc_bulk_buffer;
+	struct ipc_buffer	xc_bulk_fds;
+	size_t			xc_bulk_sent;
+	struct ipc_buffer	xc_send_ids;
+	struct ipc_buffer	xc_bulk_ids;
+	struct ipc_shm *	xc_shm_rx;
+	struct ipc_shm *	xc_shm_tx;
+	uint64_t		xc_coalesce_latency;
+	size_t			xc_coalesce_max;
+	size_t			xc_batch_count;
+	bool			xc_flush_pending;
+	dispatch_source_t	xc_send_source;
+	bool			xc_send_armed;
+	bool			xc_send_closed;
+	bool			xc_send_above;
+	size_t			xc_send_low;
+	size_t			xc_send_high;
+	size_t			xc_send_limit;
+	volatile size_t		xc_send_queued;
+	ipc_watermark_handler_t	xc_watermark_handler;
+	ipc_watermark_function_t xc_watermark_handler_f;
+	size_t			xc_recv_limit;
+	size_t			xc_recv_byte_limit;
+	_Atomic size_t		xc_recv_inflight;
+	_Atomic size_t		xc_recv_inflight_bytes;
+	_Atomic bool		xc_recv_paused;
+	struct ipc_connection_statistics xc_stats;
+	dispatch_queue_t *	xc_shards;
+	unsigned int *		xc_shard_peers;
+	unsigned int		xc_shard_count;
+	unsigned int		xc_shard;
+	dispatch_queue_t	xc_workers;
+	unsigned int		xc_worker_count;
+	unsigned int		xc_worker_busy;
+	pthread_mutex_t		xc_worker_lock;
+	TAILQ_HEAD(, ipc_connection) xc_worker_ready;
+	TAILQ_ENTRY(ipc_connection) xc_worker_link;
+	struct ipc_work *	xc_work_head;
+	struct ipc_work *	xc_work_tail;
+	bool			xc_work_running;
+	bool			xc_fair;
+	bool			xc_sched_running;
+	pthread_mutex_t		xc_sched_lock;
+	TAILQ_HEAD(, ipc_connection) xc_sched_active;
+	TAILQ_ENTRY(ipc_connection) xc_sched_link;
+	struct ipc_connection_op * xc_lane_head[IPC_LANES];
+	struct ipc_connection_op * xc_lane_tail[IPC_LANES];
+	bool			xc_lanes;
+	size_t			xc_sched_deficit;
+	bool			xc_sched_queued;
+	bool			xc_sched_visited;
+	unsigned int		xc_weight;
+	pthread_mutex_t		xc_peers_lock;
+	int			xc_listen_backlog;
+	uint64_t		xc_idle_timeout;
+	size_t			xc_max_peers;
+	dispatch_source_t	xc_reap_source;
+	_Atomic uint64_t	xc_last_active;
+	bool			xc_reaped;
+	struct ipc_listener_statistics xc_listener_stats;
+	struct ipc_pending_call ** xc_pending;
+	size_t			xc_pending_buckets;
+	size_t			xc_pending_count;
+	struct ipc_pending_call * xc_pending_pool;
+	size_t			xc_pending_pooled;
+	pthread_mutex_t		xc_pending_lock;
+	_Atomic uint64_t	xc_cancelled[IPC_CANCEL_SLOTS];
+	struct ipc_connection_op * xc_op_pool;
+	size_t			xc_op_pooled;
+	pthread_mutex_t		xc_ops_lock;
+	struct ipc_pending_timers * xc_wheel;
+	uint64_t		xc_wheel_tick;
+	size_t			xc_wheel_count;
+	dispatch_source_t	xc_wheel_source;
+	bool			xc_wheel_armed;
+	uint64_t		xc_reply_timeout;
+	bool			xc_inline_delivery;
+	ipc_batch_handler_t	xc_batch_handler;
+	ipc_batch_handler_function_t xc_batch_handler_f;
+	ipc_object_t *		xc_recv_batch;
+	size_t			xc_recv_batch_len;
+	size_t			xc_recv_batch_bytes;
+	size_t			xc_recv_batch_max;
+	struct ipc_connection ** xc_peer_table;
+	size_t			xc_peer_slots;
+	size_t			xc_peer_count;
 };
 
 #define xo_str xo_u.str
@@ -122,6 +353,7 @@ struct ipc_connection {
 #define xo_ptr xo_u.ptr
 #define xo_d xo_u.d
 #define xo_fd xo_u.fd
+#define xo_shmem xo_u.shmem
 #define xo_uuid xo_u.uuid
 #define xo_port xo_u.port
 #define xo_array xo_u.array
@@ -133,21 +365,55 @@ struct ipc_object *_ipc_prim_create_flags(int type, ipc_u value, size_t size, ui
 
 const char *_ipc_get_type_name(ipc_object_t obj);
 
+struct ipc_object *_ipc_shmem_import(int fd, size_t length);
+
+int _ipc_array_reserve(struct ipc_object *xo, size_t capacity);
+
 struct ipc_object *mpack2xpc(mpack_node_t node);
 
 void xpc2mpack(mpack_writer_t *writer, ipc_object_t xo);
 
 void ipc_object_destroy(struct ipc_object *xo);
 
+int ipc_buffer_reserve(struct ipc_buffer *buf, size_t size);
+
+int ipc_buffer_append(struct ipc_buffer *buf, const void *data, size_t length);
+
+void ipc_buffer_compact(struct ipc_buffer *buf);
+
+void ipc_buffer_destroy(struct ipc_buffer *buf);
+
 void ipc_connection_recv_message(void *context);
 
+struct ipc_connection *ipc_connection_get_peer(void *context, ipc_port_t port);
+
 void *ipc_connection_new_peer(void *context, ipc_port_t local, dispatch_source_t src);
 
 void ipc_connection_destroy_peer(void *context);
 
-int ipc_pipe_send(ipc_object_t obj, uint64_t id, ipc_port_t local);
+void ipc_connection_record_accepts(void *context, size_t pending, size_t accepted, int error);
+
+int ipc_pipe_pack(ipc_object_t obj, struct ipc_frame_header *header, struct ipc_buffer *buf, struct ipc_buffer *fds);
+
+ssize_t ipc_pipe_write(ipc_port_t local, struct ipc_buffer *buf, struct ipc_buffer *fds);
+
+ssize_t ipc_pipe_receive(ipc_port_t local, struct ipc_buffer *buf, struct ipc_buffer *fds);
+
+uint64_t ipc_monotonic_time(void);
+
+uint64_t ipc_deadline_to_wire(uint64_t deadline);
+
+uint64_t ipc_deadline_from_wire(uint64_t budget);
+
+bool ipc_frame_expired(const struct ipc_frame_header *header);
+
+int ipc_pipe_next_frame(struct ipc_buffer *buf, struct ipc_buffer *fds, struct ipc_buffer *partial, struct ipc_frame_header *header, ipc_object_t *result);
+
+struct ipc_object *ipc_pipe_unpack(const void *buf, size_t size, struct ipc_buffer *fds);
+
+int ipc_pipe_take_fd(struct ipc_buffer *fds);
 
-size_t ipc_pipe_receive(ipc_port_t local, ipc_object_t *result, uint64_t *id);
+void ipc_pipe_close_fds(struct ipc_buffer *fds);
 
 __END_DECLS
 
@@ -7,7 +7,9 @@
 //
 
 #include <sys/types.h>
+#include <sys/param.h>
 #include <sys/errno.h>
+#include <time.h>
 #ifdef __APPLE__
 #include <libkern/OSAtomic.h>
 #include "sbuf.h"
@@ -24,8 +26,6 @@
 #include "ipc_dictionary.h"
 #include "unix.h"
 
-#define RECV_BUFFER_SIZE 65536
-
 static void ipc_copy_description_level(ipc_object_t obj, struct sbuf *sbuf, int level);
 
 extern struct ipc_transport unix_transport __attribute__((weak));
@@ -81,64 +81,173 @@ void uuid_to_string(const struct uuid *u, char **s, uint32_t *status)
 
 static void ipc_dictionary_destroy(struct ipc_object *dict)
 {
-    struct ipc_dict_head *head;
-    struct ipc_dict_pair *p, *ptmp;
+    struct ipc_dict_entry *entry;
+    size_t i;
+
+    for (i = 0; i < dict->xo_size; i++)
+    {
+        entry = &dict->xo_dict.xd_entries[i];
+        free(entry->de_key);
+        ipc_release(entry->de_value);
+    }
+
+    free(dict->xo_dict.xd_entries);
+    free(dict->xo_dict.xd_index);
+}
+
+static void ipc_array_destroy(struct ipc_object *array)
+{
+    size_t i;
+
+    for (i = 0; i < array->xo_size; i++)
+        ipc_release(array->xo_array.xa_items[i]);
+
+    free(array->xo_array.xa_items);
+}
+
+int ipc_buffer_reserve(struct ipc_buffer *buf, size_t size)
+{
+    char *data;
+
+    if (buf->ib_capacity >= size)
+        return (0);
+
+    if ((data = realloc(buf->ib_data, size)) == NULL)
+    {
+        errno = ENOMEM;
+        return (-1);
+    }
+
+    buf->ib_data = data;
+    buf->ib_capacity = size;
+    return (0);
+}
+
+int ipc_buffer_append(struct ipc_buffer *buf, const void *data, size_t length)
+{
+    if (ipc_buffer_reserve(buf, buf->ib_length + length) != 0)
+        return (-1);
+
+    memcpy(buf->ib_data + buf->ib_length, data, length);
+    buf->ib_length += length;
+    return (0);
+}
+
+void ipc_buffer_compact(struct ipc_buffer *buf)
+{
+    size_t remaining = buf->ib_length - buf->ib_offset;
+
+    if (buf->ib_offset == 0)
+        return;
+
+    if (remaining > 0)
+        memmove(buf->ib_data, buf->ib_data + buf->ib_offset, remaining);
 
-    head = &dict->xo_dict;
+    buf->ib_offset = 0;
+    buf->ib_length = remaining;
 
-    TAILQ_FOREACH_SAFE(p, head, xo_link, ptmp)
+    /* Give back the memory of an oversized frame once it has been consumed */
+    if (remaining == 0 && buf->ib_capacity > IPC_RECV_BUFFER_SIZE)
     {
-        TAILQ_REMOVE(head, p, xo_link);
-        free(p->key);
-        ipc_release(p->value);
-        free(p);
+        free(buf->ib_data);
+        buf->ib_data = NULL;
+        buf->ib_capacity = 0;
     }
 }
 
-static void ipc_array_destroy(struct ipc_object *dict)
+void ipc_buffer_destroy(struct ipc_buffer *buf)
+{
+    free(buf->ib_data);
+    memset(buf, 0, sizeof(*buf));
+}
+
+/*
+ * Intrusive flush in the style of mpack_growable_writer_flush(): instead of
+ * emptying the writer it grows the connection's encode buffer in place, so
+ * the payload is written once, right behind its frame header.
+ */
+static void ipc_buffer_writer_flush(mpack_writer_t *writer, const char *data, size_t count)
 {
-    struct ipc_object *p, *ptmp;
-    struct ipc_array_head *head;
+    struct ipc_pack_context *ctx = writer->context;
+    struct ipc_buffer *buf = ctx->pc_data;
+    size_t base, used, size, new_size;
+
+    if (data == writer->buffer)
+    {
+        // teardown, the data is already where it belongs
+        if (mpack_writer_buffer_used(writer) == count)
+            return;
+
+        writer->current = writer->buffer + count;
+        count = 0;
+    }
+
+    base = (size_t)(writer->buffer - buf->ib_data);
+    used = mpack_writer_buffer_used(writer);
+    size = mpack_writer_buffer_size(writer);
 
-    head = &dict->xo_array;
+    new_size = size * 2;
+    while (new_size < used + count)
+        new_size *= 2;
 
-    TAILQ_FOREACH_SAFE(p, head, xo_link, ptmp)
+    if (ipc_buffer_reserve(buf, base + new_size) != 0)
     {
-        TAILQ_REMOVE(head, p, xo_link);
-        ipc_release(p);
+        mpack_writer_flag_error(writer, mpack_error_memory);
+        return;
+    }
+
+    writer->buffer = buf->ib_data + base;
+    writer->current = writer->buffer + used;
+    writer->end = writer->buffer + new_size;
+
+    if (count > 0)
+    {
+        memcpy(writer->current, data, count);
+        writer->current += count;
     }
 }
 
-static int ipc_pack(struct ipc_object *xo, void **buf, uint64_t id, size_t *size)
+static int ipc_pack(struct ipc_object *xo, struct ipc_buffer *buf, struct ipc_buffer *fds, struct ipc_frame_header *header)
 {
-    struct ipc_frame_header *header;
+    struct ipc_pack_context ctx = {buf, fds};
     mpack_writer_t writer;
-    char *packed, *ret;
-    size_t packed_size;
+    size_t start, base, packed_size, nfds;
 
-    mpack_writer_init_growable(&writer, &packed, &packed_size);
+    start = buf->ib_length;
+    nfds = fds->ib_length;
+    base = start + sizeof(*header);
+
+    if (ipc_buffer_reserve(buf, MAX(base + MPACK_BUFFER_SIZE, IPC_SEND_BUFFER_SIZE)) != 0)
+        return (-1);
+
+    mpack_writer_init(&writer, buf->ib_data + base, buf->ib_capacity - base);
+    mpack_writer_set_context(&writer, &ctx);
+    mpack_writer_set_flush(&writer, ipc_buffer_writer_flush);
     xpc2mpack(&writer, xo);
+    packed_size = mpack_writer_buffer_used(&writer);
 
     if (mpack_writer_destroy(&writer) != mpack_ok)
         return (-1);
 
-    ret = malloc(packed_size + sizeof(*header));
-    memset(ret, 0, packed_size + sizeof(*header));
+    /* Every descriptor of a frame has to fit in the control message that carries it */
+    nfds = (fds->ib_length - nfds) / sizeof(int);
+    if (nfds > IPC_MAX_FDS)
+    {
+        errno = EMSGSIZE;
+        return (-1);
+    }
 
-    header = (struct ipc_frame_header *)ret;
     header->length = packed_size;
-    header->id = id;
     header->version = IPC_PROTOCOL_VERSION;
+    header->nfds = nfds;
 
-    memcpy(ret + sizeof(*header), packed, packed_size);
-    *buf = ret;
-    *size = packed_size + sizeof(*header);
+    memcpy(buf->ib_data + start, header, sizeof(*header));
+    buf->ib_length = base + packed_size;
 
-    free(packed);
     return (0);
 }
 
-static struct ipc_object *ipc_unpack(void *buf, size_t size)
+static struct ipc_object *ipc_unpack(const void *buf, size_t size, struct ipc_buffer *fds)
 {
     mpack_tree_t tree;
     struct ipc_object *xo;
@@ -148,6 +257,7 @@ static struct ipc_object *ipc_unpack(void *buf, size_t size)
     {
         debugf("unpack failed: %d", mpack_tree_error(&tree)) return (NULL);
     }
+    mpack_tree_set_context(&tree, fds);
     mpack_tree_parse(&tree);
     xo = mpack2xpc(mpack_tree_root(&tree));
     mpack_tree_destroy(&tree);
@@ -168,6 +278,12 @@ void ipc_object_destroy(struct ipc_object *xo)
     if (xo->xo_ipc_type == _IPC_TYPE_DATA)
         free((void *)xo->xo_u.ptr);
 
+    if (xo->xo_ipc_type == _IPC_TYPE_SHMEM)
+    {
+        munmap(xo->xo_shmem.addr, xo->xo_size);
+        close(xo->xo_shmem.fd);
+    }
+
     free(xo);
 }
 
@@ -282,79 +398,361 @@ static void ipc_copy_description_level(ipc_object_t obj, struct sbuf *sbuf, int
         sbuf_printf(sbuf, "%p\n", ipc_data_get_bytes_ptr(obj));
         break;
 
+    case _IPC_TYPE_SHMEM:
+        sbuf_printf(sbuf, "%p, length=%zu\n", ipc_shmem_get_bytes_ptr(obj), ipc_shmem_get_length(obj));
+        break;
+
     case _IPC_TYPE_NULL:
         sbuf_printf(sbuf, "<null>\n");
         break;
     }
 }
 
-int ipc_pipe_send(ipc_object_t xobj, uint64_t id, ipc_port_t local)
+int ipc_pipe_pack(ipc_object_t xobj, struct ipc_frame_header *header, struct ipc_buffer *buf, struct ipc_buffer *fds)
 {
-    void *buf;
-    size_t size;
+    size_t start = buf->ib_length;
+    size_t nfds = fds->ib_length;
 
-    if (ipc_pack(xobj, &buf, id, &size) != 0)
+    if (ipc_pack(xobj, buf, fds, header) != 0)
     {
         debugf("pack failed");
+        buf->ib_length = start;
+        fds->ib_length = nfds;
         return (-1);
     }
 
-    if (unix_send(local, buf, size) != 0)
+    /* The receiver would drop the connection over it, so fail just this message */
+    if (header->length > IPC_MAX_FRAME_SIZE)
     {
-        debugf("transport send function failed: %s", strerror(errno));
-        free(buf);
+        debugf("message too large, length=%llu", header->length);
+        buf->ib_length = start;
+        fds->ib_length = nfds;
+        errno = EMSGSIZE;
         return (-1);
     }
 
-    free(buf);
     return (0);
 }
 
-size_t ipc_pipe_receive(ipc_port_t local, ipc_object_t *result, uint64_t *id)
+/*
+ * Writes as much of the buffer as the socket takes without blocking and
+ * returns the number of bytes written; what is left stays queued behind
+ * ib_offset. Descriptors go out at most IPC_MAX_FDS per sendmsg, and each
+ * batch keeps enough bytes back for the batches after it to ride on, so
+ * no frame is complete on the wire before all of its descriptors are.
+ */
+ssize_t ipc_pipe_write(ipc_port_t local, struct ipc_buffer *buf, struct ipc_buffer *fds)
+{
+    size_t total = 0, len, nfds, waiting;
+    ssize_t ret;
+
+    while (buf->ib_offset < buf->ib_length)
+    {
+        len = buf->ib_length - buf->ib_offset;
+        waiting = (fds->ib_length - fds->ib_offset) / sizeof(int);
+        nfds = MIN(waiting, IPC_MAX_FDS);
+        len -= howmany(waiting - nfds, IPC_MAX_FDS);
+
+        ret = unix_write(local, buf->ib_data + buf->ib_offset, len,
+                                            (const int *)(fds->ib_data + fds->ib_offset), nfds);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+
+            debugf("transport write function failed: %s", strerror(errno));
+            return (-1);
+        }
+
+        buf->ib_offset += (size_t)ret;
+        fds->ib_offset += nfds * sizeof(int);
+        total += (size_t)ret;
+    }
+
+    if (buf->ib_offset == buf->ib_length)
+    {
+        buf->ib_offset = buf->ib_length = 0;
+        fds->ib_offset = fds->ib_length = 0;
+
+        /* Keep the buffer across sends unless an unusually large message grew it */
+        if (buf->ib_capacity > IPC_SEND_BUFFER_RETAIN_SIZE)
+            ipc_buffer_destroy(buf);
+    }
+
+    return ((ssize_t)total);
+}
+
+ssize_t ipc_pipe_receive(ipc_port_t local, struct ipc_buffer *buf, struct ipc_buffer *fds)
 {
-    void *buffer = malloc(RECV_BUFFER_SIZE);
-    size_t ret = unix_recv(local, buffer, RECV_BUFFER_SIZE);
+    struct ipc_frame_header header;
+    size_t want = IPC_RECV_BUFFER_SIZE;
+    int received[IPC_MAX_FDS];
+    size_t nfds;
+    ssize_t ret;
+
+    ipc_buffer_compact(buf);
+    ipc_buffer_compact(fds);
+
+    /* Make room for the whole frame once its header has arrived */
+    if (buf->ib_length >= sizeof(header))
+    {
+        memcpy(&header, buf->ib_data, sizeof(header));
+        if (header.length <= IPC_MAX_FRAME_SIZE && header.length + sizeof(header) > want)
+            want = (size_t)header.length + sizeof(header);
+    }
+
+    /* Complete frames waiting for their descriptors must still leave room to read */
+    if (buf->ib_length >= want)
+    {
+        if (buf->ib_length > IPC_MAX_FRAME_SIZE)
+        {
+            errno = EMSGSIZE;
+            return (-1);
+        }
+
+        want = buf->ib_length + IPC_RECV_BUFFER_SIZE;
+    }
+
+    if (ipc_buffer_reserve(buf, want) != 0)
+    {
+        debugf("cannot grow receive buffer to %zu bytes", want);
+        return (-1);
+    }
+
+    do
+    {
+        nfds = IPC_MAX_FDS;
+        ret = unix_recv(local, buf->ib_data + buf->ib_length, buf->ib_capacity - buf->ib_length, received, &nfds);
+    } while (ret < 0 && errno == EINTR);
+
+    /* Descriptors are queued in arrival order and claimed by the frames that carry them */
+    if (ret > 0 && nfds > 0 && ipc_buffer_append(fds, received, nfds * sizeof(int)) != 0)
+    {
+        while (nfds > 0)
+            close(received[--nfds]);
+        return (-1);
+    }
+
     if (ret < 0)
     {
-        debugf("transport receive function failed: %s", strerror(errno));
-        free(buffer);
+        if (errno != EAGAIN)
+            debugf("transport receive function failed: %s", strerror(errno));
         return (-1);
     }
 
     if (ret == 0)
     {
         debugf("remote side closed connection, port=%d", (int)local);
-        free(buffer);
-        return (ret);
+        return (0);
     }
 
-    struct ipc_frame_header *header = (struct ipc_frame_header *)buffer;
-    if (header->length > (ret - sizeof(*header)))
+    buf->ib_length += (size_t)ret;
+    return (ret);
+}
+
+uint64_t ipc_monotonic_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec);
+}
+
+/*
+ * Deadlines cross the wire as the time left, since the peer may be on
+ * another host with an unrelated monotonic clock. One that has already
+ * passed goes out as 1ns so the receiver still sees it as expired.
+ */
+uint64_t ipc_deadline_to_wire(uint64_t deadline)
+{
+    uint64_t now;
+
+    if (deadline == 0)
+        return (0);
+
+    now = ipc_monotonic_time();
+    return (deadline > now ? deadline - now : 1);
+}
+
+uint64_t ipc_deadline_from_wire(uint64_t budget)
+{
+    return (budget != 0 ? ipc_monotonic_time() + budget : 0);
+}
+
+/*
+ * Expects a deadline already converted to the local clock. Replies are
+ * never expired here: the pending call's own timer decides what happens
+ * to a late one.
+ */
+bool ipc_frame_expired(const struct ipc_frame_header *header)
+{
+    if (header->spare[0] == 0 || (header->flags & IPC_FRAME_REPLY))
+        return (false);
+
+    return (ipc_monotonic_time() >= header->spare[0]);
+}
+
+/*
+ * Pieces of a fragmented message are collected in the partial buffer.
+ * Intermediate pieces come back without a result; the last one comes back
+ * as if the whole message had arrived in a single frame.
+ */
+static int ipc_pipe_reassemble(struct ipc_buffer *buf, struct ipc_buffer *partial, struct ipc_frame_header *header, ipc_object_t *result)
+{
+    if (header->nfds != 0 || partial->ib_length + header->length > IPC_MAX_FRAME_SIZE)
     {
-        debugf("invalid message length");
-        free(buffer);
+        debugf("invalid fragment");
+        errno = EBADMSG;
         return (-1);
     }
 
+    if (ipc_buffer_append(partial, buf->ib_data + buf->ib_offset + sizeof(*header), (size_t)header->length) != 0)
+        return (-1);
+
+    buf->ib_offset += sizeof(*header) + (size_t)header->length;
+
+    if ((header->flags & IPC_FRAME_FRAGMENT_END) == 0)
+        return (1);
+
+    if (ipc_frame_expired(header))
+        debugf("dropping expired call, id=%llu", header->id);
+    else
+        *result = ipc_pipe_unpack(partial->ib_data, partial->ib_length, NULL);
+
+    header->flags &= ~(uint64_t)(IPC_FRAME_FRAGMENT | IPC_FRAME_FRAGMENT_END);
+    header->length = partial->ib_length;
+
+    partial->ib_length = 0;
+    if (partial->ib_capacity > IPC_SEND_BUFFER_RETAIN_SIZE)
+        ipc_buffer_destroy(partial);
+
+    return (1);
+}
+
+int ipc_pipe_next_frame(struct ipc_buffer *buf, struct ipc_buffer *fds, struct ipc_buffer *partial, struct ipc_frame_header *header, ipc_object_t *result)
+{
+    size_t avail = buf->ib_length - buf->ib_offset;
+    int frame_fds[IPC_MAX_FDS];
+    struct ipc_buffer claimed = {0};
+    size_t i;
+    int fd;
+
+    if (avail < sizeof(*header))
+        return (0);
+
+    /* Frames are packed back to back, so the header may be unaligned */
+    memcpy(header, buf->ib_data + buf->ib_offset, sizeof(*header));
+
     if (header->version != IPC_PROTOCOL_VERSION)
     {
-        debugf("invalid protocol version")
-            free(buffer);
+        debugf("invalid protocol version");
+        errno = EBADMSG;
         return (-1);
     }
 
-    *id = header->id;
+    if (header->length > IPC_MAX_FRAME_SIZE)
+    {
+        debugf("invalid message length");
+        errno = EMSGSIZE;
+        return (-1);
+    }
+
+    if (avail - sizeof(*header) < header->length)
+        return (0);
+
+    if (header->nfds > IPC_MAX_FDS)
+    {
+        debugf("too many descriptors");
+        errno = EBADMSG;
+        return (-1);
+    }
+
+    /* The sender holds back a byte for every batch of descriptors it has not sent yet */
+    if (header->nfds * sizeof(int) > fds->ib_length - fds->ib_offset)
+        return (0);
 
     debugf("length=%lld", header->length);
 
-    *result = ipc_unpack(buffer + sizeof(*header), (size_t)header->length);
+    header->spare[0] = ipc_deadline_from_wire(header->spare[0]);
 
-    if (*result == NULL)
+    /* Control frames have no payload, only a shared memory setup hands its descriptor on */
+    *result = NULL;
+    if (header->length == 0 && (header->flags & IPC_FRAME_FRAGMENT) == 0)
     {
-        free(buffer);
-        return (-1);
+        if ((header->flags & IPC_FRAME_SHM_SETUP) == 0 || header->nfds != 1)
+        {
+            for (i = 0; i < header->nfds; i++)
+                close(ipc_pipe_take_fd(fds));
+            header->nfds = 0;
+        }
+
+        buf->ib_offset += sizeof(*header);
+        return (1);
     }
 
-    free(buffer);
-    return (ret);
+    if (header->flags & IPC_FRAME_FRAGMENT)
+        return (ipc_pipe_reassemble(buf, partial, header, result));
+
+    /* The caller has given up on it already, so do not spend time decoding it */
+    if (ipc_frame_expired(header))
+    {
+        debugf("dropping expired call, id=%llu", header->id);
+        for (i = 0; i < header->nfds; i++)
+            close(ipc_pipe_take_fd(fds));
+
+        buf->ib_offset += sizeof(*header) + (size_t)header->length;
+        return (1);
+    }
+
+    for (i = 0; i < header->nfds; i++)
+        frame_fds[i] = ipc_pipe_take_fd(fds);
+
+    claimed.ib_data = (char *)frame_fds;
+    claimed.ib_length = claimed.ib_capacity = (size_t)header->nfds * sizeof(int);
+
+    *result = ipc_pipe_unpack(buf->ib_data + buf->ib_offset + sizeof(*header), (size_t)header->length, &claimed);
+
+    /* Descriptors the payload did not reference are not going anywhere */
+    while ((fd = ipc_pipe_take_fd(&claimed)) != -1)
+        close(fd);
+
+    buf->ib_offset += sizeof(*header) + (size_t)header->length;
+
+    return (1);
+}
+
+struct ipc_object *ipc_pipe_unpack(const void *buf, size_t size, struct ipc_buffer *fds)
+{
+    struct ipc_object *xo;
+
+    /* Only received messages can be answered with a reply */
+    if ((xo = ipc_unpack(buf, size, fds)) != NULL)
+        xo->xo_flags |= _IPC_FROM_WIRE;
+
+    return (xo);
+}
+
+int ipc_pipe_take_fd(struct ipc_buffer *fds)
+{
+    int fd;
+
+    if (fds->ib_length - fds->ib_offset < sizeof(fd))
+        return (-1);
+
+    memcpy(&fd, fds->ib_data + fds->ib_offset, sizeof(fd));
+    fds->ib_offset += sizeof(fd);
+    return (fd);
+}
+
+void ipc_pipe_close_fds(struct ipc_buffer *fds)
+{
+    int fd;
+
+    while ((fd = ipc_pipe_take_fd(fds)) != -1)
+        close(fd);
+
+    ipc_buffer_destroy(fds);
 }
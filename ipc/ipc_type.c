@@ -9,10 +9,13 @@
 #include <sys/types.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/errno.h>
 #include "base.h"
 #include "ipc_internal.h"
 #include "ipc_array.h"
 #include "ipc_dictionary.h"
+#include "shm.h"
 
 struct _ipc_type_s
 {
@@ -30,6 +33,7 @@ xt _ipc_type_int64;
 xt _ipc_type_uint64;
 xt _ipc_type_string;
 xt _ipc_type_uuid;
+xt _ipc_type_shmem;
 xt _ipc_type_double;
 
 struct _ipc_bool_s
@@ -47,40 +51,41 @@ struct _ipc_dictionary_s {
 
 typedef const struct _ipc_dictionary_s xs;
 xs _ipc_error_connection_invalid;
+xs _ipc_error_timeout;
+xs _ipc_error_cancelled;
 
 static size_t ipc_data_hash(const uint8_t *data, size_t length);
 
-static ipc_type_t ipc_typemap[] = {
-    NULL,
-    IPC_TYPE_DICTIONARY,
-    IPC_TYPE_ARRAY,
-    IPC_TYPE_BOOL,
-    IPC_TYPE_NULL,
-    NULL,
-    IPC_TYPE_INT64,
-    IPC_TYPE_UINT64,
-    IPC_TYPE_DATE,
-    IPC_TYPE_DATA,
-    IPC_TYPE_STRING,
-    IPC_TYPE_UUID,
-    IPC_TYPE_ERROR,
-    IPC_TYPE_DOUBLE};
-
-static const char *ipc_typestr[] = {
-    "invalid",
-    "dictionary",
-    "array",
-    "bool",
-    "null",
-    "invalid",
-    "int64",
-    "uint64",
-    "date",
-    "data",
-    "string",
-    "uuid",
-    "error",
-    "double"};
+static ipc_type_t ipc_typemap[_IPC_TYPE_MAX + 1] = {
+    [_IPC_TYPE_DICTIONARY] = IPC_TYPE_DICTIONARY,
+    [_IPC_TYPE_ARRAY] = IPC_TYPE_ARRAY,
+    [_IPC_TYPE_BOOL] = IPC_TYPE_BOOL,
+    [_IPC_TYPE_NULL] = IPC_TYPE_NULL,
+    [_IPC_TYPE_INT64] = IPC_TYPE_INT64,
+    [_IPC_TYPE_UINT64] = IPC_TYPE_UINT64,
+    [_IPC_TYPE_DATE] = IPC_TYPE_DATE,
+    [_IPC_TYPE_DATA] = IPC_TYPE_DATA,
+    [_IPC_TYPE_STRING] = IPC_TYPE_STRING,
+    [_IPC_TYPE_UUID] = IPC_TYPE_UUID,
+    [_IPC_TYPE_SHMEM] = IPC_TYPE_SHMEM,
+    [_IPC_TYPE_ERROR] = IPC_TYPE_ERROR,
+    [_IPC_TYPE_DOUBLE] = IPC_TYPE_DOUBLE};
+
+static const char *ipc_typestr[_IPC_TYPE_MAX + 1] = {
+    [_IPC_TYPE_INVALID] = "invalid",
+    [_IPC_TYPE_DICTIONARY] = "dictionary",
+    [_IPC_TYPE_ARRAY] = "array",
+    [_IPC_TYPE_BOOL] = "bool",
+    [_IPC_TYPE_NULL] = "null",
+    [_IPC_TYPE_INT64] = "int64",
+    [_IPC_TYPE_UINT64] = "uint64",
+    [_IPC_TYPE_DATE] = "date",
+    [_IPC_TYPE_DATA] = "data",
+    [_IPC_TYPE_STRING] = "string",
+    [_IPC_TYPE_UUID] = "uuid",
+    [_IPC_TYPE_SHMEM] = "shmem",
+    [_IPC_TYPE_ERROR] = "error",
+    [_IPC_TYPE_DOUBLE] = "double"};
 
 __private_extern__ struct ipc_object *
 _ipc_prim_create(int type, ipc_u value, size_t size)
@@ -102,12 +107,6 @@ _ipc_prim_create_flags(int type, ipc_u value, size_t size, uint16_t flags)
     xo->xo_u = value;
     xo->xo_refcnt = 1;
 
-    if (type == _IPC_TYPE_DICTIONARY)
-        TAILQ_INIT(&xo->xo_dict);
-
-    if (type == _IPC_TYPE_ARRAY)
-        TAILQ_INIT(&xo->xo_array);
-
     return (xo);
 }
 
@@ -299,6 +298,92 @@ size_t ipc_data_get_bytes(ipc_object_t xdata, void *buffer, size_t off, size_t l
     return len;
 }
 
+static struct ipc_object *ipc_shmem_map(int fd, size_t length, int prot)
+{
+    ipc_u val = {0};
+    void *addr;
+
+    addr = mmap(NULL, length, prot, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+    {
+        debugf("mmap failed: %s", strerror(errno));
+        close(fd);
+        return (NULL);
+    }
+
+    val.shmem.addr = addr;
+    val.shmem.fd = fd;
+    return _ipc_prim_create(_IPC_TYPE_SHMEM, val, length);
+}
+
+ipc_object_t ipc_shmem_create(size_t length)
+{
+    int fd;
+
+    if (length == 0)
+    {
+        errno = EINVAL;
+        return (NULL);
+    }
+
+    if ((fd = shm_create_object(length)) == -1)
+        return (NULL);
+
+    return (ipc_shmem_map(fd, length, PROT_READ | PROT_WRITE));
+}
+
+ipc_object_t ipc_shmem_create_with_bytes(const void *bytes, size_t length)
+{
+    struct ipc_object *xo;
+
+    if ((xo = ipc_shmem_create(length)) != NULL)
+        memcpy(xo->xo_shmem.addr, bytes, length);
+
+    return (xo);
+}
+
+/* Takes ownership of a descriptor received from the peer and maps it read-only */
+__private_extern__ struct ipc_object *
+_ipc_shmem_import(int fd, size_t length)
+{
+    struct stat st;
+
+    if (length == 0 || fstat(fd, &st) != 0 || st.st_size < 0 || (uint64_t)st.st_size < length || shm_check_sealed(fd) != 0)
+    {
+        debugf("invalid shared memory object");
+        close(fd);
+        return (NULL);
+    }
+
+    return (ipc_shmem_map(fd, length, PROT_READ));
+}
+
+size_t ipc_shmem_get_length(ipc_object_t xshmem)
+{
+    struct ipc_object *xo = xshmem;
+
+    if (xo == NULL)
+        return (0);
+
+    if (xo->xo_ipc_type == _IPC_TYPE_SHMEM)
+        return (xo->xo_size);
+
+    return (0);
+}
+
+void *ipc_shmem_get_bytes_ptr(ipc_object_t xshmem)
+{
+    struct ipc_object *xo = xshmem;
+
+    if (xo == NULL)
+        return (NULL);
+
+    if (xo->xo_ipc_type == _IPC_TYPE_SHMEM)
+        return (xo->xo_shmem.addr);
+
+    return (NULL);
+}
+
 ipc_object_t ipc_string_create(const char *string)
 {
     ipc_u val = {0};
@@ -433,6 +518,10 @@ ipc_object_t ipc_copy(ipc_object_t obj)
         return (ipc_data_create(newdata,
                                 ipc_data_get_length(obj)));
 
+    case _IPC_TYPE_SHMEM:
+        return (ipc_shmem_create_with_bytes(ipc_shmem_get_bytes_ptr(obj),
+                                            ipc_shmem_get_length(obj)));
+
     case _IPC_TYPE_DICTIONARY:
         xotmp = ipc_dictionary_create(NULL, NULL, 0);
         ipc_dictionary_apply(obj, ^(char *k, ipc_object_t v) {
@@ -443,8 +532,11 @@ ipc_object_t ipc_copy(ipc_object_t obj)
 
     case _IPC_TYPE_ARRAY:
         xotmp = ipc_array_create(NULL, 0);
-        ipc_array_apply(obj, ^(size_t idx, ipc_object_t v) {
-          ipc_array_set_value(xotmp, idx, ipc_copy(v));
+        _ipc_array_reserve(xotmp, ipc_array_get_count(obj));
+        ipc_array_apply(obj, ^(size_t idx __unused, ipc_object_t v) {
+          ipc_object_t item = ipc_copy(v);
+          ipc_array_append_value(xotmp, item);
+          ipc_release(item);
           return ((bool)true);
         });
         return (xotmp);
@@ -488,6 +580,11 @@ size_t ipc_hash(ipc_object_t obj)
             ipc_data_get_bytes_ptr(obj),
             ipc_data_get_length(obj)));
 
+    case _IPC_TYPE_SHMEM:
+        return (ipc_data_hash(
+            ipc_shmem_get_bytes_ptr(obj),
+            ipc_shmem_get_length(obj)));
+
     case _IPC_TYPE_DICTIONARY:
         ipc_dictionary_apply(obj, ^(char *k, ipc_object_t v) {
           hash ^= ipc_data_hash((const uint8_t *)k, strlen(k));
@@ -0,0 +1,386 @@
+//
+//  shm.c
+//  ipc
+//
+//  Created by h4ck on 2020/11/14.
+//  Copyright © 2020 猿码工作室（https://ymlab.net）. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "base.h"
+#include "ipc_internal.h"
+#include "shm.h"
+
+/*
+ * Same-host transport: one single-producer/single-consumer byte ring per
+ * direction in a shared memory object. Ring entries are complete frames
+ * (header and payload) aligned to 8 bytes, so the consumer decodes them in
+ * place. The consumer sets sr_waiting before it goes idle; the producer
+ * only asks for a doorbell when it finds that flag set after publishing.
+ */
+
+#define SHM_MAGIC       0x69706372
+#define SHM_VERSION     1
+#define SHM_CACHELINE   64
+#define SHM_ALIGN(len)  (((len) + 7) & ~(uint64_t)7)
+
+struct shm_ring {
+    _Atomic uint64_t sr_head;
+    char sr_pad0[SHM_CACHELINE - sizeof(uint64_t)];
+    _Atomic uint64_t sr_tail;
+    _Atomic uint32_t sr_waiting;
+    char sr_pad1[SHM_CACHELINE - sizeof(uint64_t) - sizeof(uint32_t)];
+};
+
+struct shm_region {
+    uint32_t sg_magic;
+    uint32_t sg_version;
+    uint64_t sg_ring_size;
+    char sg_pad[SHM_CACHELINE - sizeof(uint32_t) * 2 - sizeof(uint64_t)];
+    struct shm_ring sg_rings[2];
+};
+
+struct ipc_shm {
+    struct shm_region *is_region;
+    size_t is_size;
+    uint64_t is_ring_size;
+    struct shm_ring *is_tx;
+    char *is_tx_data;
+    uint64_t is_tx_seq;
+    struct shm_ring *is_rx;
+    char *is_rx_data;
+    uint64_t is_rx_seq;
+    uint64_t is_rx_next;
+};
+
+static size_t shm_header_size(void) {
+    size_t page = (size_t)getpagesize();
+
+    return ((sizeof(struct shm_region) + page - 1) / page * page);
+}
+
+static int shm_open_anonymous(void) {
+#if defined(MFD_ALLOW_SEALING)
+    return (memfd_create("ipc", MFD_CLOEXEC | MFD_ALLOW_SEALING));
+#elif defined(__FreeBSD__)
+    return (shm_open(SHM_ANON, O_RDWR, 0600));
+#else
+    static _Atomic uint32_t counter;
+    char name[32];
+    int fd;
+
+    snprintf(name, sizeof(name), "/ipc.%d.%u", (int)getpid(), atomic_fetch_add(&counter, 1));
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd != -1)
+        shm_unlink(name);
+
+    return (fd);
+#endif
+}
+
+int shm_create_object(size_t size) {
+    int fd;
+
+    if ((fd = shm_open_anonymous()) == -1) {
+        debugf("shm_open failed: %s", strerror(errno));
+        return (-1);
+    }
+
+    if (ftruncate(fd, (off_t)size) != 0) {
+        debugf("ftruncate failed: %s", strerror(errno));
+        close(fd);
+        return (-1);
+    }
+
+#if defined(MFD_ALLOW_SEALING)
+    /* The receiver maps the whole object, shrinking it later would fault its reads */
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+        debugf("cannot seal shared memory: %s", strerror(errno));
+        close(fd);
+        return (-1);
+    }
+#endif
+
+    return (fd);
+}
+
+/*
+ * A descriptor from the peer is only mapped once it can no longer shrink.
+ * Where the platform has no seals there is nothing to check.
+ */
+int shm_check_sealed(int fd) {
+#if defined(MFD_ALLOW_SEALING)
+    int seals;
+
+    if ((seals = fcntl(fd, F_GET_SEALS)) == -1 || (seals & F_SEAL_SHRINK) == 0) {
+        debugf("shared memory object is not sealed");
+        errno = EPERM;
+        return (-1);
+    }
+#else
+    (void)fd;
+#endif
+
+    return (0);
+}
+
+static struct ipc_shm *shm_map(void *base, size_t size, uint64_t ring_size, bool creator) {
+    struct ipc_shm *shm;
+    char *data;
+
+    if ((shm = calloc(1, sizeof(*shm))) == NULL) {
+        errno = ENOMEM;
+        return (NULL);
+    }
+
+    shm->is_region = base;
+    shm->is_size = size;
+    shm->is_ring_size = ring_size;
+    data = (char *)base + shm_header_size();
+
+    /* Ring 0 carries client to server traffic, ring 1 the replies */
+    shm->is_tx = &shm->is_region->sg_rings[creator ? 0 : 1];
+    shm->is_tx_data = data + (creator ? 0 : ring_size);
+    shm->is_rx = &shm->is_region->sg_rings[creator ? 1 : 0];
+    shm->is_rx_data = data + (creator ? ring_size : 0);
+    shm->is_tx_seq = 1;
+    shm->is_rx_seq = 1;
+
+    return (shm);
+}
+
+int shm_create(size_t ring_size, int *fd, struct ipc_shm **shm) {
+    struct shm_region *region;
+    size_t size;
+    void *base;
+    int ret, i;
+
+    if (ring_size < (size_t)getpagesize() || (ring_size & (ring_size - 1)) != 0) {
+        errno = EINVAL;
+        return (-1);
+    }
+
+    size = shm_header_size() + ring_size * 2;
+
+    if ((ret = shm_create_object(size)) == -1)
+        return (-1);
+
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ret, 0);
+    if (base == MAP_FAILED) {
+        debugf("mmap failed: %s", strerror(errno));
+        close(ret);
+        return (-1);
+    }
+
+    region = base;
+    region->sg_magic = SHM_MAGIC;
+    region->sg_version = SHM_VERSION;
+    region->sg_ring_size = ring_size;
+    for (i = 0; i < 2; i++) {
+        atomic_init(&region->sg_rings[i].sr_head, 0);
+        atomic_init(&region->sg_rings[i].sr_tail, 0);
+        atomic_init(&region->sg_rings[i].sr_waiting, 1);
+    }
+
+    if ((*shm = shm_map(base, size, ring_size, true)) == NULL) {
+        munmap(base, size);
+        close(ret);
+        return (-1);
+    }
+
+    *fd = ret;
+    return (0);
+}
+
+int shm_attach(int fd, struct ipc_shm **shm) {
+    struct shm_region region;
+    struct stat st;
+    size_t size;
+    void *base;
+
+    if (fstat(fd, &st) != 0 || shm_check_sealed(fd) != 0)
+        return (-1);
+
+    size = (size_t)st.st_size;
+    if (size < shm_header_size()) {
+        errno = EINVAL;
+        return (-1);
+    }
+
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        debugf("mmap failed: %s", strerror(errno));
+        return (-1);
+    }
+
+    /* Validate a private copy: the peer can rewrite the header at any time */
+    memcpy(&region, base, sizeof(region));
+    if (region.sg_magic != SHM_MAGIC || region.sg_version != SHM_VERSION ||
+        region.sg_ring_size < (uint64_t)getpagesize() ||
+        (region.sg_ring_size & (region.sg_ring_size - 1)) != 0 ||
+        region.sg_ring_size > (size - shm_header_size()) / 2) {
+        debugf("invalid shared memory region");
+        munmap(base, size);
+        errno = EINVAL;
+        return (-1);
+    }
+
+    if ((*shm = shm_map(base, size, region.sg_ring_size, false)) == NULL) {
+        munmap(base, size);
+        return (-1);
+    }
+
+    return (0);
+}
+
+void shm_release(struct ipc_shm *shm) {
+    if (shm == NULL)
+        return;
+
+    munmap(shm->is_region, shm->is_size);
+    free(shm);
+}
+
+uint64_t shm_next_seq(struct ipc_shm *shm) {
+    return (shm->is_tx_seq++);
+}
+
+int shm_push(struct ipc_shm *shm, const void *frame, size_t len, bool *wakeup) {
+    struct shm_ring *ring = shm->is_tx;
+    struct ipc_frame_header pad;
+    uint64_t size = shm->is_ring_size;
+    uint64_t head, tail, offset, entry, skip = 0;
+
+    *wakeup = false;
+    entry = SHM_ALIGN(len);
+
+    if (entry > size / 2) {
+        errno = EMSGSIZE;
+        return (-1);
+    }
+
+    head = atomic_load_explicit(&ring->sr_head, memory_order_relaxed);
+    tail = atomic_load_explicit(&ring->sr_tail, memory_order_acquire);
+    offset = head & (size - 1);
+
+    /* Entries never straddle the end of the ring */
+    if (size - offset < entry)
+        skip = size - offset;
+
+    if (skip + entry > size - (head - tail)) {
+        errno = ENOBUFS;
+        return (-1);
+    }
+
+    if (skip >= sizeof(pad)) {
+        memset(&pad, 0, sizeof(pad));
+        pad.version = IPC_PROTOCOL_VERSION;
+        pad.flags = IPC_FRAME_PAD;
+        pad.length = skip - sizeof(pad);
+        memcpy(shm->is_tx_data + offset, &pad, sizeof(pad));
+    }
+
+    memcpy(shm->is_tx_data + ((head + skip) & (size - 1)), frame, len);
+    atomic_store_explicit(&ring->sr_head, head + skip + entry, memory_order_release);
+
+    /* Pairs with the fence in shm_idle(): either we see the flag or the consumer sees the data */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->sr_waiting, memory_order_relaxed) != 0)
+        *wakeup = atomic_exchange_explicit(&ring->sr_waiting, 0, memory_order_relaxed) != 0;
+
+    return (0);
+}
+
+int shm_peek(struct ipc_shm *shm, struct ipc_frame_header *header, const void **payload) {
+    struct shm_ring *ring = shm->is_rx;
+    uint64_t size = shm->is_ring_size;
+    uint64_t head, tail, start, offset, entry;
+    int ret = 0;
+
+    start = tail = atomic_load_explicit(&ring->sr_tail, memory_order_relaxed);
+    head = atomic_load_explicit(&ring->sr_head, memory_order_acquire);
+
+    while (tail != head) {
+        if (head - tail > size) {
+            errno = EBADMSG;
+            ret = -1;
+            break;
+        }
+
+        offset = tail & (size - 1);
+        if (size - offset < sizeof(*header)) {
+            tail += size - offset;
+            continue;
+        }
+
+        memcpy(header, shm->is_rx_data + offset, sizeof(*header));
+
+        if (header->version != IPC_PROTOCOL_VERSION ||
+            header->length > size - offset - sizeof(*header)) {
+            debugf("corrupted ring entry");
+            errno = EBADMSG;
+            ret = -1;
+            break;
+        }
+
+        entry = (header->flags & IPC_FRAME_PAD) ? sizeof(*header) + header->length :
+            SHM_ALIGN(sizeof(*header) + header->length);
+
+        if (entry > head - tail) {
+            errno = EBADMSG;
+            ret = -1;
+            break;
+        }
+
+        if (header->flags & IPC_FRAME_PAD) {
+            tail += entry;
+            continue;
+        }
+
+        /* A frame that overtook a socket fallback must wait for it */
+        if (header->seq == shm->is_rx_seq) {
+            shm->is_rx_next = tail + entry;
+            *payload = shm->is_rx_data + offset + sizeof(*header);
+            ret = 1;
+        }
+
+        break;
+    }
+
+    if (tail != start)
+        atomic_store_explicit(&ring->sr_tail, tail, memory_order_release);
+
+    return (ret);
+}
+
+void shm_consume(struct ipc_shm *shm) {
+    atomic_store_explicit(&shm->is_rx->sr_tail, shm->is_rx_next, memory_order_release);
+    shm->is_rx_seq++;
+}
+
+void shm_skip(struct ipc_shm *shm, uint64_t seq) {
+    shm->is_rx_seq = seq + 1;
+}
+
+bool shm_idle(struct ipc_shm *shm) {
+    struct ipc_frame_header header;
+    const void *payload;
+
+    atomic_store_explicit(&shm->is_rx->sr_waiting, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (shm_peek(shm, &header, &payload) == 0)
+        return (true);
+
+    atomic_store_explicit(&shm->is_rx->sr_waiting, 0, memory_order_relaxed);
+    return (false);
+}
@@ -0,0 +1,42 @@
+//
+//  shm.h
+//  ipc
+//
+//  Created by h4ck on 2020/11/14.
+//  Copyright © 2020 猿码工作室（https://ymlab.net）. All rights reserved.
+//
+
+#ifndef shm_h
+#define shm_h
+
+#include <ipc/base.h>
+
+__BEGIN_DECLS
+
+#define SHM_RING_SIZE (1024 * 1024)
+
+int shm_create_object(size_t size);
+
+int shm_check_sealed(int fd);
+
+int shm_create(size_t ring_size, int *fd, struct ipc_shm **shm);
+
+int shm_attach(int fd, struct ipc_shm **shm);
+
+void shm_release(struct ipc_shm *shm);
+
+uint64_t shm_next_seq(struct ipc_shm *shm);
+
+int shm_push(struct ipc_shm *shm, const void *frame, size_t len, bool *wakeup);
+
+int shm_peek(struct ipc_shm *shm, struct ipc_frame_header *header, const void **payload);
+
+void shm_consume(struct ipc_shm *shm);
+
+void shm_skip(struct ipc_shm *shm, uint64_t seq);
+
+bool shm_idle(struct ipc_shm *shm);
+
+__END_DECLS
+
+#endif /* shm_h */
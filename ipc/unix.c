@@ -17,6 +17,8 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <pthread.h>
 #include <dispatch/dispatch.h>
@@ -24,6 +26,21 @@
 #include "ipc_internal.h"
 #include "unix.h"
 
+#define UNIX_ACCEPT_BATCH_MAX   SOMAXCONN
+#define UNIX_ACCEPT_BACKOFF     (100 * NSEC_PER_MSEC)
+
+static int unix_set_flags(int fd) {
+    int flags;
+
+    if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+        return (-1);
+
+    if ((flags = fcntl(fd, F_GETFL)) == -1)
+        return (-1);
+
+    return (fcntl(fd, F_SETFL, flags | O_NONBLOCK));
+}
+
 int unix_tcp_lookup(const char *ip, uint16_t port, ipc_port_t *fd) {
     struct sockaddr_in addr;
     addr.sin_len = sizeof(addr);
@@ -38,6 +55,10 @@ int unix_tcp_lookup(const char *ip, uint16_t port, ipc_port_t *fd) {
         return (-1);
     }
     
+    /* Sends never block the connection's queue, see ipc_pipe_write() */
+    if (unix_set_flags(ret) != 0)
+        debugf("fcntl failed: %s", strerror(errno));
+    
     *fd = (ipc_port_t)(long)ret;
     return (0);
 }
@@ -63,7 +84,7 @@ int unix_tcp_listen(const char *ip, uint16_t port, ipc_port_t *fd) {
         return (-1);
     }
     
-    if (listen(listenfd, 5) != 0) {
+    if (listen(listenfd, IPC_LISTEN_BACKLOG) != 0) {
         debugf("listen failed: %s", strerror(errno));
         return (-1);
     }
@@ -87,6 +108,9 @@ int unix_lookup(const char *path, ipc_port_t *port) {
         return (-1);
     }
     
+    if (unix_set_flags(ret) != 0)
+        debugf("fcntl failed: %s", strerror(errno));
+    
     *port = (ipc_port_t)(long)ret;
     return (0);
 }
@@ -112,7 +136,7 @@ int unix_listen(const char *path, ipc_port_t *port) {
         return (-1);
     }
     
-    if (listen(ret, 5) != 0) {
+    if (listen(ret, IPC_LISTEN_BACKLOG) != 0) {
         debugf("listen failed: %s", strerror(errno));
         return (-1);
     }
@@ -121,6 +145,34 @@ int unix_listen(const char *path, ipc_port_t *port) {
     return (0);
 }
 
+int unix_set_backlog(ipc_port_t port, int backlog) {
+    /* Listening again on a listening socket only resizes its queue */
+    if (listen((int)port, backlog) != 0) {
+        debugf("listen failed: %s", strerror(errno));
+        return (-1);
+    }
+
+    return (0);
+}
+
+static int unix_accept(int fd) {
+    int sock;
+
+#if defined(SOCK_CLOEXEC) && defined(SOCK_NONBLOCK)
+    sock = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+#else
+    sock = accept(fd, NULL, NULL);
+    if (sock != -1 && unix_set_flags(sock) != 0) {
+        debugf("fcntl failed: %s", strerror(errno));
+        close(sock);
+        errno = ECONNABORTED;
+        return (-1);
+    }
+#endif
+
+    return (sock);
+}
+
 int unix_release(ipc_port_t port) {
     int fd = (int)port;
     
@@ -142,9 +194,10 @@ dispatch_source_t unix_create_client_source(ipc_port_t port, void *context, disp
     dispatch_set_context(ret, context);
     dispatch_source_set_event_handler_f(ret, ipc_connection_recv_message);
     dispatch_source_set_cancel_handler(ret, ^{
+        /* The connection tears down its own sources on the socket before it is closed */
+        ipc_connection_destroy_peer(dispatch_get_context(ret));
         shutdown(fd, SHUT_RDWR);
         close(fd);
-        ipc_connection_destroy_peer(dispatch_get_context(ret));
     });
     
     return (ret);
@@ -154,40 +207,143 @@ dispatch_source_t unix_create_server_source(ipc_port_t port, void *context, disp
     int fd = (int)port;
     dispatch_source_t ret = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ,
                                  (uintptr_t)port, 0, tq);
+    
+    /* The accept loop ends on EAGAIN instead of blocking */
+    if (unix_set_flags(fd) != 0)
+        debugf("fcntl failed: %s", strerror(errno));
+    
     dispatch_set_context(ret, context);
     dispatch_source_set_event_handler(ret, ^{
-        int sock;
+        int sock, error = 0;
+        size_t pending, accepted = 0;
         ipc_port_t client_port;
         dispatch_source_t client_source;
         
-        sock = accept(fd, NULL, NULL);
-        client_port = (ipc_port_t)(long)sock;
-        client_source = unix_create_client_source(client_port, NULL, tq);
-        ipc_connection_new_peer(context, client_port, client_source);
+        /* For a listening socket the source data is the number of queued connections */
+        pending = dispatch_source_get_data(ret);
+        
+        while (accepted < UNIX_ACCEPT_BATCH_MAX) {
+            if ((sock = unix_accept(fd)) == -1) {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    error = errno;
+                break;
+            }
+            
+            accepted++;
+            client_port = (ipc_port_t)(long)sock;
+            client_source = unix_create_client_source(client_port, NULL, tq);
+            ipc_connection_new_peer(context, client_port, client_source);
+        }
+        
+        ipc_connection_record_accepts(context, pending, accepted, error);
+        
+        /* Out of descriptors the queue stays readable: back off instead of spinning */
+        if (error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM) {
+            debugf("accept failed: %s", strerror(error));
+            dispatch_suspend(ret);
+            dispatch_after(dispatch_time(DISPATCH_TIME_NOW, UNIX_ACCEPT_BACKOFF), tq, ^{
+                dispatch_resume(ret);
+            });
+        }
     });
     return (ret);
 }
 
-size_t unix_send(ipc_port_t local, void *buf, size_t len) {
+/* Sockets are non-blocking; a full socket buffer waits for room */
+static int unix_wait_writable(int fd) {
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+    int ret;
+
+    do {
+        ret = poll(&pfd, 1, -1);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0)
+        return (-1);
+
+    if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+        errno = EPIPE;
+        return (-1);
+    }
+
+    return (0);
+}
+
+int unix_send(ipc_port_t local, void *buf, size_t len) {
+    return (unix_send_fds(local, buf, len, NULL, 0));
+}
+
+ssize_t unix_write(ipc_port_t local, void *buf, size_t len, const int *fds, size_t nfds) {
     int fd = (int)local;
     struct msghdr msg;
     struct iovec iov = { .iov_base = buf, .iov_len = len };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int) * IPC_MAX_FDS)];
+    } control;
+    struct cmsghdr *cmsg;
+    
+    debugf("local=%d, msg=%p, size=%ld, nfds=%ld", (int)local, buf, len, nfds);
     
-    debugf("local=%d, msg=%p, size=%ld", (int)local, buf, len);
+    if (nfds > IPC_MAX_FDS) {
+        errno = EINVAL;
+        return (-1);
+    }
     
     memset(&msg, 0, sizeof(struct msghdr));
     msg.msg_iov = &iov;
     msg.msg_iovlen = 1;
     
-    if (sendmsg(fd, &msg, 0) < 0)
-        return (-1);
+    if (nfds > 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = (socklen_t)CMSG_SPACE(sizeof(int) * nfds);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = (socklen_t)CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    }
+    
+    return (sendmsg(fd, &msg, MSG_DONTWAIT));
+}
+
+int unix_send_fds(ipc_port_t local, void *buf, size_t len, const int *fds, size_t nfds) {
+    ssize_t sent;
+    
+    /* A stream socket may accept only part of a large buffer */
+    while (len > 0) {
+        sent = unix_write(local, buf, len, fds, nfds);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN && unix_wait_writable((int)local) == 0)
+                continue;
+            return (-1);
+        }
+        
+        /* The descriptors travel with the first chunk only */
+        fds = NULL;
+        nfds = 0;
+        buf = (char *)buf + sent;
+        len -= (size_t)sent;
+    }
     
     return (0);
 }
 
-size_t unix_recv(ipc_port_t local, void *buf, size_t len) {
+ssize_t unix_recv(ipc_port_t local, void *buf, size_t len, int *fds, size_t *nfds) {
     int fd = (int)local;
     struct msghdr msg;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int) * IPC_MAX_FDS)];
+    } control;
+    struct cmsghdr *cmsg;
+    size_t count = 0, i, n;
+    int *received;
     
     memset(&msg, 0, sizeof(struct msghdr));
     struct iovec iov = { .iov_base = buf, .iov_len = len };
@@ -197,15 +353,33 @@ size_t unix_recv(ipc_port_t local, void *buf, size_t len) {
     msg.msg_namelen = 0;
     msg.msg_iov = &iov;
     msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
     
-    recvd = recvmsg(fd, &msg, 0);
+    recvd = recvmsg(fd, &msg, MSG_DONTWAIT);
     if (recvd < 0)
         return (-1);
     
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        
+        received = (int *)CMSG_DATA(cmsg);
+        n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (i = 0; i < n; i++) {
+            if (count < *nfds)
+                fds[count++] = received[i];
+            else
+                close(received[i]);
+        }
+    }
+    
+    *nfds = count;
+    
     if (recvd == 0)
         return (0);
     
-    debugf("local=%d, msg=%p, len=%ld", (int)local, buf, recvd);
+    debugf("local=%d, msg=%p, len=%ld, nfds=%ld", (int)local, buf, recvd, count);
     
     return (recvd);
 }
@@ -21,6 +21,8 @@ int unix_tcp_listen(const char *ip, uint16_t port, ipc_port_t *fd);
 
 int unix_tcp_lookup(const char *ip, uint16_t port, ipc_port_t *fd);
 
+int unix_set_backlog(ipc_port_t port, int backlog);
+
 int unix_release(ipc_port_t port);
 
 int unix_port_compare(ipc_port_t p1, ipc_port_t p2);
@@ -29,9 +31,13 @@ dispatch_source_t unix_create_client_source(ipc_port_t port, void *, dispatch_qu
 
 dispatch_source_t unix_create_server_source(ipc_port_t port, void *, dispatch_queue_t tq);
 
-size_t unix_send(ipc_port_t local, void *buf, size_t len);
+int unix_send(ipc_port_t local, void *buf, size_t len);
+
+int unix_send_fds(ipc_port_t local, void *buf, size_t len, const int *fds, size_t nfds);
+
+ssize_t unix_write(ipc_port_t local, void *buf, size_t len, const int *fds, size_t nfds);
 
-size_t unix_recv(ipc_port_t local, void *buf, size_t len);
+ssize_t unix_recv(ipc_port_t local, void *buf, size_t len, int *fds, size_t *nfds);
 
 __END_DECLS
 